@@ -0,0 +1,30 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * BENCHMARKS
+ * Entry points of the cmavnode_bench modes and the helpers they share.
+ * Nothing here is built into cmavnode itself.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "../src/latencyhistogram.h"
+
+// Modes, each takes the arguments after its name
+int runNodeBench(int argc, char **argv);
+int runParserBench(int argc, char **argv);
+int runRecvBench(int argc, char **argv);
+
+// Builds a MAVLink2 frame with a good checksum into out and returns its
+// length. msgid must be in the dialect
+size_t buildFrame(uint32_t msgid, uint8_t sysid, uint8_t compid, uint8_t seq,
+                  const uint8_t *payload, uint8_t payload_len, uint8_t *out);
+
+// Prints one line of percentiles, in microseconds
+void printLatency(const std::string &label, const latencyhistogram &histogram);
+
+#endif
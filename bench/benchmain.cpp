@@ -0,0 +1,31 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * BENCHMARKS
+ * cmavnode_bench <mode> [options], see --help of each mode.
+ */
+
+#include <iostream>
+#include <string>
+
+#include "bench.h"
+
+int main(int argc, char** argv)
+{
+    std::string mode = argc > 1 ? argv[1] : "";
+
+    // Each mode parses the rest of the command line itself
+    if (mode == "node")
+        return runNodeBench(argc - 1, argv + 1);
+    if (mode == "parser")
+        return runParserBench(argc - 1, argv + 1);
+    if (mode == "recv")
+        return runRecvBench(argc - 1, argv + 1);
+
+    std::cerr << "Usage: cmavnode_bench <mode> [options]" << std::endl
+              << "Modes:" << std::endl
+              << "\tnode\tforwarding latency through a running cmavnode" << std::endl
+              << "\tparser\tframe parser throughput" << std::endl
+              << "\trecv\tper packet cost of a link's receive path" << std::endl;
+    return 1;
+}
@@ -0,0 +1,50 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * BENCHMARKS
+ * Helpers shared by the cmavnode_bench modes.
+ */
+
+#include "bench.h"
+
+#include <string.h>
+#include <iomanip>
+#include <iostream>
+
+#include "../src/mavparser.h"
+
+size_t buildFrame(uint32_t msgid, uint8_t sysid, uint8_t compid, uint8_t seq,
+                  const uint8_t *payload, uint8_t payload_len, uint8_t *out)
+{
+    out[0] = MAVLINK_STX;
+    out[1] = payload_len;
+    out[2] = 0; // incompat flags
+    out[3] = 0; // compat flags
+    out[4] = seq;
+    out[5] = sysid;
+    out[6] = compid;
+    out[7] = msgid & 0xFF;
+    out[8] = (msgid >> 8) & 0xFF;
+    out[9] = (msgid >> 16) & 0xFF;
+    memcpy(out + MAVLINK_NUM_HEADER_BYTES, payload, payload_len);
+
+    size_t ck = MAVLINK_NUM_HEADER_BYTES + payload_len;
+    const mavlink_msg_entry_t *entry = mavlink_get_msg_entry(msgid);
+    uint8_t crc_extra = entry ? entry->crc_extra : 0;
+    uint16_t crc = crc_calculate_table(out + 1, ck - 1);
+    crc = crc_calculate_table(&crc_extra, 1, crc);
+    out[ck] = crc & 0xFF;
+    out[ck + 1] = crc >> 8;
+    return ck + MAVLINK_NUM_CHECKSUM_BYTES;
+}
+
+void printLatency(const std::string &label, const latencyhistogram &histogram)
+{
+    std::cout << std::left << std::setw(24) << label << std::right
+              << " n=" << std::setw(8) << histogram.count()
+              << " p50=" << std::setw(7) << histogram.percentile(0.5)
+              << " p90=" << std::setw(7) << histogram.percentile(0.9)
+              << " p99=" << std::setw(7) << histogram.percentile(0.99)
+              << " p99.9=" << std::setw(7) << histogram.percentile(0.999)
+              << " max=" << std::setw(7) << histogram.max() << " us" << std::endl;
+}
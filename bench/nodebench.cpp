@@ -0,0 +1,379 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * NODE BENCHMARK
+ * Measures how long packets take to get through a cmavnode binary, and what
+ * it costs in CPU as the number of links grows. Writes a config of UDP links
+ * on localhost in pairs, starts the node on it, sends ATTITUDE packets into
+ * the first link of each pair at a steady rate and times each one until it
+ * comes out of the second. Each pair's sender has its own system ID and the
+ * second link only outputs that system, so every packet is routed against
+ * every link but only leaves through one. At low rates every packet finds
+ * the node idle, which is what a command sent after a quiet spell waits for.
+ */
+
+#include "bench.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include "../src/mavparser.h"
+#include "../src/monoclock.h"
+
+// Payload index of warm up packets, which aren't timed
+#define NODE_BENCH_WARMUP_INDEX 0xFFFFFFFF
+// How long the node gets to start forwarding
+#define NODE_BENCH_STARTUP_MS 5000
+// How long to wait for the last packets to come out
+#define NODE_BENCH_SETTLE_MS 1000
+// Sends nothing, links outputting only this system output nothing
+#define NODE_BENCH_SILENT_SYSID 255
+
+namespace
+{
+struct bench_options
+{
+    std::string cmavnode;
+    std::string node_args;
+    std::string config;
+    int port = 0;
+    double rate = 0;
+    double seconds = 0;
+};
+
+// The bench's end of one of the node's links
+struct bench_link
+{
+    int fd = -1;
+    sockaddr_in node;
+};
+
+// Bench side of each pair of node links
+struct link_pair
+{
+    bench_link in;
+    bench_link out;
+};
+
+// What the node used over the timed part of a run
+struct node_usage
+{
+    double cpu_seconds = 0;
+    int threads = 0;
+};
+
+bool openLink(int local_port, int node_port, bench_link &link)
+{
+    link.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    local.sin_port = htons(local_port);
+    if (link.fd < 0 || bind(link.fd, (sockaddr *)&local, sizeof(local)) < 0)
+    {
+        std::cerr << "Bench: can't bind port " << local_port << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    link.node = local;
+    link.node.sin_port = htons(node_port);
+    return true;
+}
+
+// Node link i listens on port + 2i and sends to port + 2i + 1
+void writeConfig(const bench_options &options, int num_links)
+{
+    std::ofstream config(options.config.c_str());
+    for (int i = 0; i < num_links; i++)
+    {
+        config << "[bench" << i << "]\n"
+               << "    type=udp\n"
+               << "    targetip=127.0.0.1\n"
+               << "    targetport=" << options.port + 2 * i + 1 << "\n"
+               << "    localport=" << options.port + 2 * i << "\n";
+        // Pair p's sender is system p + 1, only its output link passes it
+        config << "    output_only_from=" << (i % 2 ? i / 2 + 1 : NODE_BENCH_SILENT_SYSID) << "\n";
+    }
+}
+
+pid_t startNode(const bench_options &options)
+{
+    std::vector<std::string> args = {options.cmavnode, "-f", options.config};
+    if (!options.node_args.empty())
+    {
+        std::vector<std::string> extra;
+        boost::split(extra, options.node_args, boost::is_any_of(" "), boost::token_compress_on);
+        args.insert(args.end(), extra.begin(), extra.end());
+    }
+
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    // The node's console output would only get in the way
+    int null_fd = open("/dev/null", O_RDWR);
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+
+    std::vector<char *> argv;
+    for (auto arg = args.begin(); arg != args.end(); ++arg)
+        argv.push_back(&(*arg)[0]);
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    _exit(127);
+}
+
+void stopNode(pid_t pid)
+{
+    kill(pid, SIGINT);
+    for (int i = 0; i < 50; i++)
+    {
+        if (waitpid(pid, nullptr, WNOHANG) == pid)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+// CPU time and thread count of a process, from /proc
+node_usage readUsage(pid_t pid)
+{
+    node_usage usage;
+    std::ifstream stat(("/proc/" + std::to_string(pid) + "/stat").c_str());
+    std::string line;
+    std::getline(stat, line);
+    // Fields after the command name, which may hold spaces, start at state
+    size_t end_of_name = line.rfind(')');
+    if (end_of_name != std::string::npos)
+    {
+        std::istringstream fields(line.substr(end_of_name + 2));
+        std::string field;
+        long utime = 0, stime = 0;
+        for (int i = 3; fields >> field; i++)
+        {
+            if (i == 14)
+                utime = std::stol(field);
+            else if (i == 15)
+                stime = std::stol(field);
+            else if (i == 20)
+                usage.threads = std::stoi(field);
+        }
+        usage.cpu_seconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    }
+    return usage;
+}
+
+void sendAttitude(bench_link &link, uint8_t sysid, uint32_t index, uint8_t seq)
+{
+    // time_boot_ms carries the index, the rest is non zero so nothing is trimmed
+    uint8_t payload[28];
+    memcpy(payload, &index, sizeof(index));
+    float value = 1.0f;
+    for (size_t offset = 4; offset < sizeof(payload); offset += sizeof(value))
+        memcpy(payload + offset, &value, sizeof(value));
+
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    size_t len = buildFrame(MAVLINK_MSG_ID_ATTITUDE, sysid, 1, seq, payload, sizeof(payload), buf);
+    sendto(link.fd, buf, len, 0, (sockaddr *)&link.node, sizeof(link.node));
+}
+
+// Records the latency of every packet coming out of the pairs until stop is
+// set, warmed_up counts the pairs a warm up packet has come through
+void receive(std::vector<link_pair> &pairs, const std::vector<std::atomic<mono_time> > &sent_at,
+             latencyhistogram &latency, std::atomic<size_t> &warmed_up, std::atomic<bool> &stop)
+{
+    std::vector<pollfd> poll_fds;
+    for (auto pair = pairs.begin(); pair != pairs.end(); ++pair)
+        poll_fds.push_back({pair->out.fd, POLLIN, 0});
+    std::vector<bool> pair_warm(pairs.size(), false);
+
+    mavparser parser;
+    uint8_t buf[65536];
+    while (!stop)
+    {
+        if (poll(poll_fds.data(), poll_fds.size(), 100) <= 0)
+            continue;
+
+        for (size_t p = 0; p < poll_fds.size(); p++)
+        {
+            if (!(poll_fds[p].revents & POLLIN))
+                continue;
+
+            ssize_t len = recv(poll_fds[p].fd, buf, sizeof(buf), 0);
+            mono_time now = monoclock::now();
+            size_t pos = 0;
+            frame_ptr frame;
+            while (len > 0)
+            {
+                pos += parser.parse(buf + pos, len - pos, frame);
+                if (!frame)
+                    break;
+
+                uint32_t index;
+                memcpy(&index, frame->payload(), sizeof(index));
+                if (index == NODE_BENCH_WARMUP_INDEX)
+                {
+                    if (!pair_warm[p])
+                        warmed_up++;
+                    pair_warm[p] = true;
+                }
+                else if (index < sent_at.size() && sent_at[index] != 0)
+                {
+                    latency.record(now - sent_at[index]);
+                }
+                frame.reset();
+            }
+        }
+    }
+}
+
+// One run of the node on num_links links, prints a line of results
+bool runLinks(const bench_options &options, int num_links)
+{
+    std::vector<link_pair> pairs(num_links / 2);
+    for (size_t p = 0; p < pairs.size(); p++)
+    {
+        int in_port = options.port + 4 * p;
+        if (!openLink(in_port + 1, in_port, pairs[p].in) || !openLink(in_port + 3, in_port + 2, pairs[p].out))
+            return false;
+    }
+
+    writeConfig(options, num_links);
+    pid_t node = startNode(options);
+
+    // Packet i * pairs + p is pair p's ith packet
+    size_t per_pair = (size_t)(options.rate * options.seconds);
+    size_t total = per_pair * pairs.size();
+    std::vector<std::atomic<mono_time> > sent_at(total);
+    for (size_t i = 0; i < total; i++)
+        sent_at[i] = 0;
+    latencyhistogram latency;
+    std::atomic<size_t> warmed_up{0};
+    std::atomic<bool> stop{false};
+    std::thread receiver(receive, std::ref(pairs), std::cref(sent_at), std::ref(latency),
+                         std::ref(warmed_up), std::ref(stop));
+
+    // Until the node is up and forwarding on every pair
+    for (int waited = 0; warmed_up < pairs.size() && waited < NODE_BENCH_STARTUP_MS; waited += 50)
+    {
+        for (size_t p = 0; p < pairs.size(); p++)
+            sendAttitude(pairs[p].in, p + 1, NODE_BENCH_WARMUP_INDEX, 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    bool ok = warmed_up == pairs.size();
+    if (!ok)
+        std::cerr << "Bench: " << options.cmavnode << " didn't forward on every link" << std::endl;
+
+    node_usage before = readUsage(node);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    // Pairs are spread evenly over each period rather than sent in a burst
+    for (size_t i = 0; ok && i < total; i++)
+    {
+        std::this_thread::sleep_until(start + std::chrono::microseconds(
+                                          (int64_t)(i * MONO_US_PER_SEC / (options.rate * pairs.size()))));
+        sent_at[i] = monoclock::now();
+        size_t p = i % pairs.size();
+        sendAttitude(pairs[p].in, p + 1, i, (i / pairs.size()) & 0xFF);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    node_usage after = readUsage(node);
+    if (ok)
+        std::this_thread::sleep_for(std::chrono::milliseconds(NODE_BENCH_SETTLE_MS));
+
+    stop = true;
+    receiver.join();
+    stopNode(node);
+    for (auto pair = pairs.begin(); pair != pairs.end(); ++pair)
+    {
+        close(pair->in.fd);
+        close(pair->out.fd);
+    }
+    if (!ok)
+        return false;
+
+    std::cout << std::fixed << std::setprecision(1)
+              << num_links << " links: sent " << total << " packets at " << options.rate * pairs.size()
+              << " Hz, " << total - latency.count() << " lost, node threads " << after.threads
+              << ", node CPU " << 100 * (after.cpu_seconds - before.cpu_seconds) / elapsed << "%" << std::endl;
+    printLatency("  ingress to egress", latency);
+    return true;
+}
+}
+
+int runNodeBench(int argc, char **argv)
+{
+    bench_options options;
+    std::string links_string;
+    boost::program_options::options_description desc("node options");
+    desc.add_options()
+    ("help", "Print help messages")
+    ("cmavnode", boost::program_options::value<std::string>(&options.cmavnode)->default_value("./cmavnode"), "cmavnode binary to run")
+    ("node-args", boost::program_options::value<std::string>(&options.node_args)->default_value(""), "extra arguments for cmavnode, e.g. \"-t 2\"")
+    ("config", boost::program_options::value<std::string>(&options.config)->default_value("/tmp/cmavnode_bench.conf"), "where to write the node's config file")
+    ("port", boost::program_options::value<int>(&options.port)->default_value(17000), "first of the UDP ports to use, two per link")
+    ("links", boost::program_options::value<std::string>(&links_string)->default_value("2"), "number of links, a comma separated list runs the node once for each")
+    ("rate", boost::program_options::value<double>(&options.rate)->default_value(50), "packets per second through each pair of links")
+    ("seconds", boost::program_options::value<double>(&options.seconds)->default_value(10), "how long to send for");
+
+    boost::program_options::variables_map vm;
+    try
+    {
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+        boost::program_options::notify(vm);
+    }
+    catch (boost::program_options::error& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+
+    std::vector<int> link_counts;
+    std::vector<std::string> link_strs;
+    boost::split(link_strs, links_string, boost::is_any_of(","));
+    for (auto link_str = link_strs.begin(); link_str != link_strs.end(); ++link_str)
+    {
+        int num_links = atoi(link_str->c_str());
+        // A sysid per pair, one left over for links which output nothing
+        if (num_links < 2 || num_links % 2 || num_links / 2 >= NODE_BENCH_SILENT_SYSID)
+        {
+            std::cerr << "Bench: links must be even, from 2 to " << 2 * (NODE_BENCH_SILENT_SYSID - 1) << std::endl;
+            return 1;
+        }
+        link_counts.push_back(num_links);
+    }
+
+    if (vm.count("help") || options.rate <= 0 || options.seconds <= 0)
+    {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+
+    for (auto num_links = link_counts.begin(); num_links != link_counts.end(); ++num_links)
+    {
+        if (!runLinks(options, *num_links))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * PARSER BENCHMARK
+ * Byte throughput of a link's receive framing, mlink::parseIncoming, against
+ * the per character loop links used before it: mavlink_frame_char_buffer on
+ * the link's own parse state, then re-encoding each message into a frame.
+ * Both parse the same generated stream of telemetry, optionally with line
+ * noise mixed in, fed in read sized chunks the way a link receives it.
+ */
+
+#include "bench.h"
+
+#include <stdlib.h>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include "../src/mlink.h"
+
+namespace
+{
+// A link with no transport which counts the frames parseIncoming passes on
+class parselink : public mlink
+{
+public:
+    parselink(link_info info_) : mlink(info_) {}
+
+    long frames = 0;
+
+    void receive(const uint8_t *buf, size_t len)
+    {
+        parseIncoming(buf, len);
+    }
+
+    void onMessageRecv(const frame_ptr &frame) override
+    {
+        frames++;
+    }
+};
+
+// A typical telemetry mix, by message and share of the stream
+const struct
+{
+    uint32_t msgid;
+    int weight;
+} stream_mix[] =
+{
+    { MAVLINK_MSG_ID_HEARTBEAT, 1 },
+    { MAVLINK_MSG_ID_SYS_STATUS, 2 },
+    { MAVLINK_MSG_ID_ATTITUDE, 10 },
+    { MAVLINK_MSG_ID_GLOBAL_POSITION_INT, 5 },
+    { MAVLINK_MSG_ID_LOG_DATA, 2 },
+};
+
+std::vector<uint8_t> buildStream(size_t bytes, double noise)
+{
+    std::vector<uint8_t> stream;
+    srand(1);
+    int total_weight = 0;
+    for (size_t i = 0; i < sizeof(stream_mix) / sizeof(stream_mix[0]); i++)
+        total_weight += stream_mix[i].weight;
+
+    uint8_t seq = 0;
+    while (stream.size() < bytes)
+    {
+        // A burst of noise in place of some of the frames
+        if (rand() < noise * RAND_MAX)
+        {
+            int noise_len = 1 + rand() % 32;
+            for (int i = 0; i < noise_len; i++)
+                stream.push_back(rand() & 0xFF);
+            continue;
+        }
+
+        int pick = rand() % total_weight;
+        size_t m = 0;
+        while (pick >= stream_mix[m].weight)
+            pick -= stream_mix[m++].weight;
+
+        const mavlink_msg_entry_t *entry = mavlink_get_msg_entry(stream_mix[m].msgid);
+        uint8_t payload[MAVLINK_MAX_PAYLOAD_LEN];
+        uint8_t payload_len = entry ? entry->max_msg_len : 0;
+        for (int i = 0; i < payload_len; i++)
+            payload[i] = 1 + rand() % 255;
+
+        uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+        size_t len = buildFrame(stream_mix[m].msgid, 1, 1, seq++, payload, payload_len, frame);
+        stream.insert(stream.end(), frame, frame + len);
+    }
+    return stream;
+}
+
+// Runs parse over the stream until at least min_seconds have passed,
+// returns bytes per second and sets frames to the frames per pass
+template <typename Parse>
+double measure(const std::vector<uint8_t> &stream, double min_seconds, long &frames, Parse parse)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    long passes = 0;
+    do
+    {
+        frames = parse(stream);
+        passes++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    while (elapsed < min_seconds);
+    return (double)stream.size() * passes / elapsed;
+}
+}
+
+int runParserBench(int argc, char **argv)
+{
+    size_t bytes = 0;
+    size_t chunk = 0;
+    double noise = 0;
+    double seconds = 0;
+    boost::program_options::options_description desc("parser options");
+    desc.add_options()
+    ("help", "Print help messages")
+    ("bytes", boost::program_options::value<size_t>(&bytes)->default_value(4 << 20), "size of the generated stream")
+    ("chunk", boost::program_options::value<size_t>(&chunk)->default_value(1024), "bytes per read")
+    ("noise", boost::program_options::value<double>(&noise)->default_value(0), "chance of a burst of line noise in place of a frame, 0-1")
+    ("seconds", boost::program_options::value<double>(&seconds)->default_value(2), "how long to run each parser for");
+
+    boost::program_options::variables_map vm;
+    try
+    {
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+        boost::program_options::notify(vm);
+    }
+    catch (boost::program_options::error& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+    if (vm.count("help") || chunk == 0)
+    {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+
+    std::vector<uint8_t> stream = buildStream(bytes, noise);
+
+    long char_frames = 0;
+    double char_rate = measure(stream, seconds, char_frames, [chunk](const std::vector<uint8_t> &data)
+    {
+        mavlink_message_t buffer{};
+        mavlink_status_t buffer_status{};
+        mavlink_message_t msg;
+        mavlink_status_t status;
+        long frames = 0;
+        for (size_t pos = 0; pos < data.size(); pos += chunk)
+        {
+            size_t end = std::min(pos + chunk, data.size());
+            for (size_t i = pos; i < end; i++)
+            {
+                if (mavlink_frame_char_buffer(&buffer, &buffer_status, data[i], &msg, &status) == MAVLINK_FRAMING_OK)
+                {
+                    frame_ptr frame = mavframe::alloc();
+                    frame->len = mavlink_msg_to_send_buffer(frame->data, &msg);
+                    frame->parseHeader();
+                    frames++;
+                }
+            }
+        }
+        return frames;
+    });
+
+    long bulk_frames = 0;
+    double bulk_rate = measure(stream, seconds, bulk_frames, [chunk](const std::vector<uint8_t> &data)
+    {
+        link_info info;
+        info.link_name = "bench";
+        parselink link(info);
+        for (size_t pos = 0; pos < data.size(); pos += chunk)
+            link.receive(&data[pos], std::min(chunk, data.size() - pos));
+        return link.frames;
+    });
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "Stream of " << stream.size() << " bytes in " << chunk << " byte reads, noise " << noise << std::endl
+              << "per char, re-encode" << std::setw(8) << char_rate / 1e6 << " MB/s "
+              << std::setw(8) << char_rate / 1e6 * char_frames / stream.size() << " M frames/s, "
+              << char_frames << " frames" << std::endl
+              << "parseIncoming      " << std::setw(8) << bulk_rate / 1e6 << " MB/s "
+              << std::setw(8) << bulk_rate / 1e6 * bulk_frames / stream.size() << " M frames/s, "
+              << bulk_frames << " frames" << std::endl
+              << "Speedup " << std::setprecision(2) << bulk_rate / char_rate << "x" << std::endl;
+    return 0;
+}
@@ -0,0 +1,263 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * RECEIVE BENCHMARK
+ * Per packet cost of mlink::onMessageRecv, the work a link does for every
+ * frame it parses before the frame is queued for routing: stats, routing
+ * updates and, when reject_repeat_packets is set, the duplicate filter.
+ * Frames are fed in read sized batches from a few systems, the incoming
+ * queue is emptied between batches outside the timing. Receive times are
+ * simulated at --rate so the filter holds as many packets as a node
+ * receiving that much traffic would.
+ * The duplicate filter is also timed on its own next to the one cmavnode
+ * used before dedupfilter, rebuilt here from the old record_incoming_packet
+ * so the two can be compared from this tree.
+ */
+
+#include "bench.h"
+
+#include <string.h>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include "../src/mlink.h"
+
+// Frames per batch, kept under the incoming queue's length
+#define RECV_BENCH_BATCH 512
+// Systems the frames come from
+#define RECV_BENCH_SYSTEMS 4
+
+namespace
+{
+// A link with no transport, frames are handed straight to onMessageRecv
+class benchlink : public mlink
+{
+public:
+    benchlink(link_info info_) : mlink(info_) {}
+
+    // Like a link's receive handler, one receive time per read
+    void receive(const std::vector<frame_ptr> &frames, mono_time now)
+    {
+        rx_time = now;
+        for (auto frame = frames.begin(); frame != frames.end(); ++frame)
+            onMessageRecv(*frame);
+    }
+};
+
+// Frames are numbered across every case, the duplicate filter is shared
+// by all links and would otherwise see one case's packets as repeats of
+// another's
+uint32_t next_index = 0;
+
+// Fills batch with ATTITUDE frames no earlier batch has held
+void buildBatch(std::vector<frame_ptr> &batch)
+{
+    batch.clear();
+    for (uint32_t i = 0; i < RECV_BENCH_BATCH; i++)
+    {
+        uint32_t index = next_index++;
+        uint8_t payload[28];
+        memcpy(payload, &index, sizeof(index));
+        memset(payload + sizeof(index), 1, sizeof(payload) - sizeof(index));
+
+        frame_ptr frame = mavframe::alloc();
+        uint8_t sysid = 1 + index % RECV_BENCH_SYSTEMS;
+        uint8_t seq = index / RECV_BENCH_SYSTEMS;
+        frame->len = buildFrame(MAVLINK_MSG_ID_ATTITUDE, sysid, 1, seq, payload, sizeof(payload), frame->data);
+        frame->parseHeader();
+        batch.push_back(frame);
+    }
+}
+
+// The duplicate filter before dedupfilter. Links decoded every packet, so
+// it serialised the message again, took the CRC of the payload and looked
+// that up per sysid in an ordered map under one lock. Each heartbeat
+// flushed entries older than a second, here that's once a simulated second.
+// The old code also read the wall clock for every new packet, which is
+// left out
+class oldfilter
+{
+public:
+    bool insert(const mavlink_message_t &msg, mono_time now)
+    {
+        uint8_t snapshot_array[MAVLINK_MAX_PACKET_LEN];
+        mavlink_msg_to_send_buffer(snapshot_array, &msg);
+
+        std::lock_guard<std::mutex> lock(recently_received_mutex);
+
+        if (now - last_flush >= MONO_US_PER_SEC)
+        {
+            flush(now);
+            last_flush = now;
+        }
+
+        uint16_t payload_crc = 0;
+        if (msg.magic == MAVLINK_STX_MAVLINK1)
+            payload_crc = crc_calculate(snapshot_array + 6, msg.len);
+        else if (msg.magic == MAVLINK_STX)
+            payload_crc = crc_calculate(snapshot_array + 11, msg.len);
+
+        std::map<uint16_t, mono_time> &recent = recently_received[msg.sysid];
+        if (recent.find(payload_crc) != recent.end())
+            return false;
+        recent.insert({payload_crc, now});
+        return true;
+    }
+
+private:
+    std::unordered_map<uint8_t, std::map<uint16_t, mono_time> > recently_received;
+    std::mutex recently_received_mutex;
+    mono_time last_flush = 0;
+
+    void flush(mono_time now)
+    {
+        for (auto sysid = recently_received.begin(); sysid != recently_received.end(); ++sysid)
+        {
+            for (auto packet = sysid->second.begin(); packet != sysid->second.end();)
+            {
+                if (now - packet->second > MONO_US_PER_SEC)
+                    packet = sysid->second.erase(packet);
+                else
+                    ++packet;
+            }
+        }
+    }
+};
+
+// Decodes a frame the way the old receive path handed packets on
+void decodeFrame(const mavframe &frame, mavlink_message_t &msg)
+{
+    msg.magic = frame.magic;
+    msg.len = frame.payload_len;
+    msg.incompat_flags = frame.incompat_flags;
+    msg.compat_flags = frame.magic == MAVLINK_STX ? frame.data[3] : 0;
+    msg.seq = frame.seq;
+    msg.sysid = frame.sysid;
+    msg.compid = frame.compid;
+    msg.msgid = frame.msgid;
+    memcpy(_MAV_PAYLOAD_NON_CONST(&msg), frame.payload(), frame.payload_len);
+    const uint8_t *ck = frame.payload() + frame.payload_len;
+    msg.checksum = ck[0] | (ck[1] << 8);
+}
+
+// ns per new packet over at least min_seconds of the duplicate filter on
+// its own, the old one or dedupfilter, with packets arriving at rate a second
+double measureFilter(bool old, double rate, double min_seconds)
+{
+    oldfilter before;
+    dedupfilter filter;
+
+    std::vector<frame_ptr> batch;
+    std::vector<mavlink_message_t> decoded(RECV_BENCH_BATCH);
+    mono_time start_time = monoclock::now();
+    double timed = 0;
+    long packets = 0;
+    while (timed < min_seconds)
+    {
+        buildBatch(batch);
+        for (size_t i = 0; i < batch.size(); i++)
+            decodeFrame(*batch[i], decoded[i]);
+
+        // One receive time per read, as on a link
+        mono_time now = start_time + (mono_time)(packets * 1e6 / rate);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (old)
+        {
+            for (size_t i = 0; i < batch.size(); i++)
+                before.insert(decoded[i], now);
+        }
+        else
+        {
+            for (size_t i = 0; i < batch.size(); i++)
+                filter.insert(dedupfilter::hashFrame(*batch[i]), now);
+        }
+        timed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        packets += batch.size();
+    }
+    return timed * 1e9 / packets;
+}
+
+// ns per packet over at least min_seconds of onMessageRecv, with packets
+// arriving at rate a second. With repeats every batch is received a second
+// time, as over a redundant link
+double measure(bool reject_repeats, bool repeats, double rate, double min_seconds)
+{
+    link_info info;
+    info.link_name = "bench";
+    info.reject_repeat_packets = reject_repeats;
+    benchlink link(info);
+
+    std::vector<frame_ptr> batch;
+    frame_ptr drained;
+    mono_time start_time = monoclock::now();
+    double timed = 0;
+    long packets = 0;
+    while (timed < min_seconds)
+    {
+        buildBatch(batch);
+
+        for (int pass = 0; pass < (repeats ? 2 : 1); pass++)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            link.receive(batch, start_time + (mono_time)(packets * 1e6 / rate));
+            timed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            packets += batch.size();
+
+            while (link.qReadIncoming(&drained))
+                drained.reset();
+        }
+    }
+    return timed * 1e9 / packets;
+}
+}
+
+int runRecvBench(int argc, char **argv)
+{
+    double rate = 0;
+    double seconds = 0;
+    boost::program_options::options_description desc("recv options");
+    desc.add_options()
+    ("help", "Print help messages")
+    ("rate", boost::program_options::value<double>(&rate)->default_value(10000), "packets a second the link is receiving")
+    ("seconds", boost::program_options::value<double>(&seconds)->default_value(2), "how long to time each case for");
+
+    boost::program_options::variables_map vm;
+    try
+    {
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+        boost::program_options::notify(vm);
+    }
+    catch (boost::program_options::error& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+    if (vm.count("help") || rate <= 0)
+    {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+
+    // Measured before printing, new links log the systems they learn
+    double plain = measure(false, false, rate, seconds);
+    double reject_new = measure(true, false, rate, seconds);
+    double reject_repeats = measure(true, true, rate, seconds);
+    double filter_before = measureFilter(true, rate, seconds);
+    double filter_now = measureFilter(false, rate, seconds);
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "onMessageRecv per packet at " << rate << " packets/s" << std::endl
+              << "reject_repeat_packets off         " << std::setw(8) << plain << " ns" << std::endl
+              << "reject_repeat_packets on, new     " << std::setw(8) << reject_new << " ns" << std::endl
+              << "reject_repeat_packets on, repeats " << std::setw(8) << reject_repeats << " ns" << std::endl
+              << "Duplicate filter alone per new packet" << std::endl
+              << "before dedupfilter                " << std::setw(8) << filter_before << " ns" << std::endl
+              << "dedupfilter                       " << std::setw(8) << filter_now << " ns" << std::endl;
+    return 0;
+}
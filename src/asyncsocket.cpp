@@ -6,13 +6,14 @@
  */
 
 #include "asyncsocket.h"
+#include "mavhelper.h"
 
 // Fully defined constructor
 asyncsocket::asyncsocket(
     const std::string& host,
     const std::string& hostport,
     const std::string& listenport,
-    link_info info_) : io_service_(), mlink(info_),
+    link_info info_) : mlink(info_),
     socket_(io_service_, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), std::stoi(listenport)))
 {
     prep(host, hostport);
@@ -22,7 +23,7 @@ asyncsocket::asyncsocket(
 asyncsocket::asyncsocket(
     const std::string& host,
     const std::string& hostport,
-    link_info info_) : io_service_(), mlink(info_),
+    link_info info_) : mlink(info_),
     socket_(io_service_, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0))
 {
     prep(host, hostport);
@@ -49,28 +50,30 @@ void asyncsocket::prep(
         endpoint_ = *iter;
     }
 
-    //Start the read and write threads
-    write_thread = boost::thread(&asyncsocket::runWriteThread, this);
-
-    //Start the receive
-    receive();
-
-    read_thread = boost::thread(&asyncsocket::runReadThread, this);
+    start();
 }
 
 // Server constructor
 asyncsocket::asyncsocket(
     const std::string& listenport,
-    link_info info_) : io_service_(), mlink(info_),
+    link_info info_) : mlink(info_),
     socket_(io_service_, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), std::stoi(listenport)))
 {
-    //Start the read and write threads
-    write_thread = boost::thread(&asyncsocket::runWriteThread, this);
+    start();
+}
 
-    //Start the receive
-    receive();
+// Multi client server constructor
+asyncsocket::asyncsocket(
+    const std::string& listenport,
+    int client_timeout_ms_,
+    link_info info_) : mlink(info_),
+    socket_(io_service_, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), std::stoi(listenport)))
+{
+    multi_client = true;
+    endpointlock = false;
+    client_timeout_ms = client_timeout_ms_;
 
-    read_thread = boost::thread(&asyncsocket::runReadThread, this);
+    start();
 }
 
 // Broadcast constructor
@@ -78,7 +81,7 @@ asyncsocket::asyncsocket(bool bcastlock,
                          const std::string& bindaddress,
                          const std::string& bcastaddress,
                          const std::string& bcastport,
-                         link_info info_) : io_service_(), mlink(info_),
+                         link_info info_) : mlink(info_),
     socket_(io_service_, boost::asio::ip::udp::endpoint(boost::asio::ip::address::from_string(bindaddress), 0))
 {
     socket_.set_option(boost::asio::ip::udp::socket::reuse_address(true));
@@ -87,47 +90,95 @@ asyncsocket::asyncsocket(bool bcastlock,
     boost::asio::ip::udp::endpoint senderEndpoint(boost::asio::ip::address_v4::from_string(bcastaddress), std::stoi(bcastport));
     endpoint_ = senderEndpoint;
 
-    //Start the read and write threads
-    write_thread = boost::thread(&asyncsocket::runWriteThread, this);
-
     endpointlock = bcastlock;
+    start();
+}
+
+void asyncsocket::start()
+{
+    batch_size = std::max(1, std::min(info.udp_batch, UDP_MAX_BATCH));
+#ifdef ASYNCSOCKET_MMSG
+    if (batch_size > 1)
+    {
+        batch_in.resize(batch_size * MAV_INCOMING_BUFFER_LENGTH);
+        batch_addrs.resize(batch_size);
+        recv_iovs.resize(batch_size);
+        recv_hdrs.resize(batch_size);
+        send_iovs.resize(batch_size);
+        send_hdrs.resize(batch_size);
+        batch_out.reserve(batch_size);
+        // The receive side always uses the same buffers, point at them once
+        for (int i = 0; i < batch_size; i++)
+        {
+            recv_iovs[i].iov_base = &batch_in[i * MAV_INCOMING_BUFFER_LENGTH];
+            recv_iovs[i].iov_len = MAV_INCOMING_BUFFER_LENGTH;
+        }
+    }
+#else
+    if (batch_size > 1)
+    {
+        std::cout << "Link: " << info.link_name << " udp_batch is not supported on this platform" << std::endl;
+        batch_size = 1;
+    }
+#endif
+
+    if (multi_client)
+    {
+        if (info.coalesce_us > 0)
+        {
+            std::cout << "Link: " << info.link_name << " coalesce_us is not supported on udpserver links" << std::endl;
+            info.coalesce_us = 0;
+        }
+        expireClients();
+    }
+
     //Start the receive
     receive();
 
-    read_thread = boost::thread(&asyncsocket::runReadThread, this);
+    startIO();
 }
 
 asyncsocket::~asyncsocket()
 {
-    //Force run() to return then join thread
-    io_service_.stop();
-    read_thread.join();
-
-    //force write thread to return then join thread
-    exitFlag = true;
-    write_thread.join();
+    stopIO();
 
     //Debind
     socket_.close();
 }
 
-void asyncsocket::send(uint8_t *buf, std::size_t buf_size)
+void asyncsocket::send(const frame_ptr &frame, const boost::asio::ip::udp::endpoint &dest)
 {
     socket_.async_send_to(
-        boost::asio::buffer(buf, buf_size), endpoint_,
-        boost::bind(&asyncsocket::handleSendTo, this,
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
+        boost::asio::buffer(frame->data, frame->len), dest,
+        strand_.wrap(boost::bind(&asyncsocket::handleSendTo, this,
+                                 boost::asio::placeholders::error,
+                                 boost::asio::placeholders::bytes_transferred,
+                                 frame)));
 }
 
 void asyncsocket::receive()
 {
+#ifdef ASYNCSOCKET_MMSG
+    if (batch_size > 1)
+    {
+        // Wait for the socket to be readable then pull everything with recvmmsg
+        socket_.async_receive(boost::asio::null_buffers(),
+                              strand_.wrap(boost::bind(&asyncsocket::handleReadable, this,
+                                                       boost::asio::placeholders::error)));
+        return;
+    }
+#endif
 // async_receive_from will override endpoint_ so if we want to receive from multiple clients use async_receive
-    auto bound = boost::bind(&asyncsocket::handleReceiveFrom, this,
-                             boost::asio::placeholders::error,
-                             boost::asio::placeholders::bytes_transferred);
+    auto bound = strand_.wrap(boost::bind(&asyncsocket::handleReceiveFrom, this,
+                                          boost::asio::placeholders::error,
+                                          boost::asio::placeholders::bytes_transferred));
     auto buffer = boost::asio::buffer(data_in_, MAV_INCOMING_BUFFER_LENGTH);
-    if(!endpointlock)
+    if(multi_client)
+    {
+        //every sender is a client, so keep track of who each datagram came from
+        socket_.async_receive_from(buffer, remote_endpoint_, bound);
+    }
+    else if(!endpointlock)
     {
         //this one only gets used for broadcast when we want to support multiple clients
         socket_.async_receive(buffer, bound);
@@ -143,39 +194,206 @@ void asyncsocket::receive()
     }
 }
 
-void asyncsocket::processAndSend(mavlink_message_t *msgToConvert)
+void asyncsocket::processAndSend(const frame_ptr &frame)
 {
-    //pack into buf and get size_t
-    uint8_t tmplen = mavlink_msg_to_send_buffer(data_out_, msgToConvert);
-    //ERROR HANDLING?
-
     bool should_drop = shouldDropPacket();
+    if(should_drop)
+        return;
+
+    msg_stats.recordOut(*frame);
+
+    if (multi_client)
+    {
+        // Addressed to one system: only the clients it sits behind get it,
+        // unless no client has heard from it yet
+        int16_t sysIDmsg = -1;
+        int16_t compIDmsg = -1;
+        if (frame->msgid != MAVLINK_MSG_ID_HEARTBEAT)
+            getTargets(*frame, sysIDmsg, compIDmsg);
+
+        bool targeted = false;
+        if (sysIDmsg > 0)
+        {
+            for (auto client = clients.begin(); client != clients.end(); ++client)
+                targeted |= client->sysids[sysIDmsg];
+        }
+        for (auto client = clients.begin(); client != clients.end(); ++client)
+        {
+            if (!targeted || client->sysids[sysIDmsg])
+                sendDatagram(&frame, 1, client->endpoint);
+        }
+        return;
+    }
+
+    if (info.coalesce_us > 0)
+    {
+        // Doesn't fit in the datagram being built, send that first
+        if (!coalesce_frames.empty() &&
+                coalesce_bytes + frame->len > (size_t)info.coalesce_max_bytes)
+            flushCoalesced();
+
+        coalesce_frames.push_back(frame);
+        coalesce_bytes += frame->len;
+
+        if (coalesce_bytes >= (size_t)info.coalesce_max_bytes ||
+                coalesce_frames.size() >= UDP_MAX_COALESCE_FRAMES)
+        {
+            flushCoalesced();
+        }
+        else if (coalesce_frames.size() == 1)
+        {
+            // First frame of a new datagram starts the deadline
+            coalesce_timer.expires_from_now(boost::posix_time::microseconds(info.coalesce_us));
+            coalesce_timer.async_wait(strand_.wrap(boost::bind(&asyncsocket::handleCoalesceTimer, this,
+                                                               boost::asio::placeholders::error,
+                                                               coalesce_generation)));
+        }
+        return;
+    }
+
     //send on socket
-    if(!should_drop)
-        send(data_out_, tmplen);
+    sendDatagram(&frame, 1, endpoint_);
 }
 
+void asyncsocket::flushCoalesced()
+{
+    coalesce_generation++;
+    coalesce_timer.cancel();
+    if (coalesce_frames.empty())
+        return;
 
+    sendDatagram(coalesce_frames.data(), coalesce_frames.size(), endpoint_);
+    coalesce_frames.clear();
+    coalesce_bytes = 0;
+}
 
-//Async callback receiver
-void asyncsocket::handleReceiveFrom(const boost::system::error_code& error,
-                                    size_t bytes_recvd)
+void asyncsocket::handleCoalesceTimer(const boost::system::error_code& error, unsigned int generation)
 {
-    if (!error && bytes_recvd > 0)
+    // Cancelled, or the datagram it was started for has already gone
+    if (error || generation != coalesce_generation)
+        return;
+    flushCoalesced();
+    // Not called from a drain, so send the batch here
+    flushOutgoing();
+}
+
+void asyncsocket::sendDatagram(const frame_ptr *frames, size_t count,
+                               const boost::asio::ip::udp::endpoint &dest)
+{
+#ifdef ASYNCSOCKET_MMSG
+    if (batch_size > 1)
     {
-        //message received
-        //do something
-        mavlink_message_t msg;
-        mavlink_status_t status;
+        // Held until flushOutgoing, unless the socket has been backed up for a while
+        if (batch_out.size() + count > MAV_OUTGOING_LENGTH)
+        {
+            std::cout << "UDP: " << info.link_name << " send batch is full, dropping packet" << std::endl;
+            return;
+        }
+        batch_out.insert(batch_out.end(), frames, frames + count);
+        batch_counts.push_back(count);
+        batch_dests.push_back(dest);
+        if (batch_counts.size() % batch_size == 0)
+            flushOutgoing();
+        return;
+    }
+#endif
+    if (count == 1)
+    {
+        send(frames[0], dest);
+        return;
+    }
+
+    // Gather the frames straight from their buffers, they are held
+    // until the send completes
+    auto held = std::make_shared<std::vector<frame_ptr> >(frames, frames + count);
+    std::vector<boost::asio::const_buffer> buffers;
+    buffers.reserve(count);
+    for (auto frame = held->begin(); frame != held->end(); ++frame)
+        buffers.push_back(boost::asio::buffer((*frame)->data, (*frame)->len));
 
-        for (size_t i = 0; i < bytes_recvd; i++)
+    socket_.async_send_to(
+        buffers, dest,
+        strand_.wrap(boost::bind(&asyncsocket::handleSendDatagram, this,
+                                 boost::asio::placeholders::error,
+                                 boost::asio::placeholders::bytes_transferred,
+                                 held)));
+}
+
+void asyncsocket::flushOutgoing()
+{
+#ifdef ASYNCSOCKET_MMSG
+    // A handleWritable is already on its way and will flush
+    if (send_waiting)
+        return;
+
+    size_t sent = 0;
+    size_t sent_frames = 0;
+    while (sent < batch_counts.size())
+    {
+        int count = std::min<size_t>(batch_size, batch_counts.size() - sent);
+
+        // Each datagram gets a run of iovecs, one per frame
+        size_t frames = 0;
+        for (int i = 0; i < count; i++)
+            frames += batch_counts[sent + i];
+        if (send_iovs.size() < frames)
+            send_iovs.resize(frames);
+
+        size_t iov = 0;
+        for (int i = 0; i < count; i++)
         {
-            if (mavlink_parse_char(MAVLINK_COMM_0, data_in_[i], &msg, &status))
+            send_hdrs[i].msg_hdr = msghdr();
+            send_hdrs[i].msg_hdr.msg_name = batch_dests[sent + i].data();
+            send_hdrs[i].msg_hdr.msg_namelen = batch_dests[sent + i].size();
+            send_hdrs[i].msg_hdr.msg_iov = &send_iovs[iov];
+            send_hdrs[i].msg_hdr.msg_iovlen = batch_counts[sent + i];
+            for (size_t j = 0; j < batch_counts[sent + i]; j++, iov++)
             {
-                onMessageRecv(&msg);
+                const frame_ptr &frame = batch_out[sent_frames + iov];
+                send_iovs[iov].iov_base = frame->data;
+                send_iovs[iov].iov_len = frame->len;
             }
         }
 
+        int result = sendmmsg(socket_.native_handle(), send_hdrs.data(), count, MSG_DONTWAIT);
+        if (result < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Socket buffer is full, carry on once it drains
+                send_waiting = true;
+                socket_.async_send(boost::asio::null_buffers(),
+                                   strand_.wrap(boost::bind(&asyncsocket::handleWritable, this,
+                                                            boost::asio::placeholders::error)));
+                break;
+            }
+            // The first datagram failed outright, skip it like a failed async_send_to
+            result = 1;
+        }
+        for (int i = 0; i < result; i++)
+            sent_frames += batch_counts[sent + i];
+        sent += result;
+    }
+    batch_out.erase(batch_out.begin(), batch_out.begin() + sent_frames);
+    batch_counts.erase(batch_counts.begin(), batch_counts.begin() + sent);
+    batch_dests.erase(batch_dests.begin(), batch_dests.begin() + sent);
+#endif
+}
+
+
+//Async callback receiver
+void asyncsocket::handleReceiveFrom(const boost::system::error_code& error,
+                                    size_t bytes_recvd)
+{
+    if (!error && bytes_recvd > 0)
+    {
+        rx_time = monoclock::now();
+        if (multi_client)
+            clientSeen(remote_endpoint_);
+
+        //message received
+        parseIncoming(data_in_, bytes_recvd);
+
         //And start reading again
         receive();
     }
@@ -186,42 +404,164 @@ void asyncsocket::handleReceiveFrom(const boost::system::error_code& error,
     }
 }
 
-//Async post send callback
-void asyncsocket::handleSendTo(const boost::system::error_code& error,
-                               size_t bytes_recvd)
+#ifdef ASYNCSOCKET_MMSG
+//Socket readable callback for batched receives
+void asyncsocket::handleReadable(const boost::system::error_code& error)
 {
-    if (!error && bytes_recvd > 0)
+    if (error)
+        throw Exception("UDPClient: Error in handle_readable");
+
+    // Keep reading until the socket is empty, at most a batch per call
+    while (true)
     {
-        //Everything was ok
+        for (int i = 0; i < batch_size; i++)
+        {
+            recv_hdrs[i].msg_hdr = msghdr();
+            recv_hdrs[i].msg_hdr.msg_name = &batch_addrs[i];
+            recv_hdrs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            recv_hdrs[i].msg_hdr.msg_iov = &recv_iovs[i];
+            recv_hdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int count = recvmmsg(socket_.native_handle(), recv_hdrs.data(), batch_size, MSG_DONTWAIT, nullptr);
+        if (count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            throw Exception("UDPClient: Error in recvmmsg");
+        }
+
+        // One clock read covers the whole batch
+        rx_time = monoclock::now();
+        for (int i = 0; i < count; i++)
+        {
+            // Same as async_receive_from, lock onto whoever sent last
+            boost::asio::ip::udp::endpoint *from = multi_client ? &remote_endpoint_ : &endpoint_;
+            if ((multi_client || endpointlock) && recv_hdrs[i].msg_hdr.msg_namelen <= from->capacity())
+            {
+                memcpy(from->data(), &batch_addrs[i], recv_hdrs[i].msg_hdr.msg_namelen);
+                from->resize(recv_hdrs[i].msg_hdr.msg_namelen);
+            }
+            if (multi_client)
+                clientSeen(remote_endpoint_);
+            parseIncoming((const uint8_t *)recv_iovs[i].iov_base, recv_hdrs[i].msg_len);
+        }
+
+        if (count < batch_size)
+            break;
     }
-    else
+
+    if (endpointlock)
     {
-        //There was an error
+        if (sender_endpoint_ == nullptr)
+        {
+            sender_endpoint_ = new boost::asio::ip::udp::endpoint();
+        }
+        (*sender_endpoint_) = endpoint_;
+    }
+
+    //And start reading again
+    receive();
+}
+
+//Socket writable callback for batched sends
+void asyncsocket::handleWritable(const boost::system::error_code& error)
+{
+    send_waiting = false;
+    if (error)
+    {
+        //There was an error, drop what we had rather than spin on it
+        batch_out.clear();
+        batch_counts.clear();
+        batch_dests.clear();
+        return;
+    }
+    flushOutgoing();
+}
+#endif
+
+void asyncsocket::clientSeen(const boost::asio::ip::udp::endpoint &from)
+{
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        if (clients[i].endpoint == from)
+        {
+            clients[i].last_seen = rx_time;
+            current_client = i;
+            return;
+        }
     }
+
+    std::cout << "Adding client: " << from.address().to_string() << ":" << from.port()
+              << " to link: " << info.link_name << std::endl;
+    udp_client client;
+    client.endpoint = from;
+    client.last_seen = rx_time;
+    clients.push_back(client);
+    current_client = clients.size() - 1;
 }
 
-void asyncsocket::runReadThread()
+void asyncsocket::onMessageRecv(const frame_ptr &frame)
 {
-    //gets run in thread
-    //Because io_service.run() will block while socket is open
-    io_service_.run();
+    if (multi_client && current_client < clients.size())
+        clients[current_client].sysids.set(frame->sysid);
+
+    mlink::onMessageRecv(frame);
 }
 
-void asyncsocket::runWriteThread()
+void asyncsocket::onSystemDead(uint8_t sysid)
 {
-    //block so we dont send before the socket is initialized
-    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
-    //busy wait on the spsc_queueo
-    mavlink_message_t tmpMsg;
+    for (auto client = clients.begin(); client != clients.end(); ++client)
+        client->sysids.reset(sysid);
+}
 
-    // Thread loop
-    while (!exitFlag)
+void asyncsocket::expireClients()
+{
+    mono_time now = monoclock::now();
+    for (auto client = clients.begin(); client != clients.end();)
     {
-        while (qMavOut.pop(tmpMsg))
+        if (now - client->last_seen > (mono_time)client_timeout_ms * MONO_US_PER_MS)
         {
-            out_counter.decrement();
-            processAndSend(&tmpMsg);
+            std::cout << "Removing client: " << client->endpoint.address().to_string() << ":" << client->endpoint.port()
+                      << " from link: " << info.link_name << std::endl;
+            client = clients.erase(client);
         }
-        boost::this_thread::sleep(boost::posix_time::milliseconds(OUT_QUEUE_EMPTY_SLEEP));
+        else
+        {
+            ++client;
+        }
+    }
+
+    client_timer.expires_from_now(boost::posix_time::seconds(1));
+    client_timer.async_wait(strand_.wrap(boost::bind(&asyncsocket::handleClientTimer, this,
+                                                     boost::asio::placeholders::error)));
+}
+
+void asyncsocket::handleClientTimer(const boost::system::error_code& error)
+{
+    if (!error)
+        expireClients();
+}
+
+//Async post send callback for coalesced datagrams
+void asyncsocket::handleSendDatagram(const boost::system::error_code&,
+                                     size_t,
+                                     std::shared_ptr<std::vector<frame_ptr> >)
+{
+    //frames are released here
+}
+
+//Async post send callback
+void asyncsocket::handleSendTo(const boost::system::error_code& error,
+                               size_t bytes_recvd,
+                               frame_ptr)
+{
+    if (!error && bytes_recvd > 0)
+    {
+        //Everything was ok
+    }
+    else
+    {
+        //There was an error
     }
 }
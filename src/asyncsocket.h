@@ -11,9 +11,22 @@
 #include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <string>
+#include <vector>
+#include <bitset>
 
 #include "mlink.h"
 
+// recvmmsg/sendmmsg are Linux only, elsewhere udp_batch is ignored
+#ifdef __linux__
+#include <sys/socket.h>
+#define ASYNCSOCKET_MMSG
+#endif
+
+// Upper limit on udp_batch
+#define UDP_MAX_BATCH 64
+// Most frames in one coalesced datagram, asio gathers at most 64 buffers per send
+#define UDP_MAX_COALESCE_FRAMES 64
+
 class asyncsocket: public mlink
 {
 public:
@@ -42,11 +55,13 @@ public:
         const std::string& hostport,
         link_info info_);
 
-    ~asyncsocket();
+    //Multi client server, keeps every client heard from in the last client_timeout_ms
+    asyncsocket(
+        const std::string& listenport,
+        int client_timeout_ms_,
+        link_info info_);
 
-    //override virtuals from link
-    void runWriteThread();
-    void runReadThread();
+    ~asyncsocket();
 
     // return endpoint corresponding to sender (if any)
     boost::asio::ip::udp::endpoint *sender_endpoint() override
@@ -59,10 +74,13 @@ private:
     void handleReceiveFrom(const boost::system::error_code& error,
                            size_t bytes_recvd);
     void handleSendTo(const boost::system::error_code& error,
-                      size_t bytes_recvd);
+                      size_t bytes_recvd,
+                      frame_ptr frame);
+    void handleSendDatagram(const boost::system::error_code& error,
+                            size_t bytes_recvd,
+                            std::shared_ptr<std::vector<frame_ptr> > frames);
 
     //UDP Stuff
-    boost::asio::io_service io_service_;
     boost::asio::ip::udp::socket socket_;
     boost::asio::ip::udp::endpoint endpoint_;
 
@@ -70,14 +88,81 @@ private:
 
     bool endpointlock = true;
 
-    //takes message, puts onto buff and calls send
-    void processAndSend(mavlink_message_t *msgToConvert);
+    // Multi client server mode, clients are sent only what is addressed to
+    // the systems behind them plus anything not addressed to one system
+    bool multi_client = false;
+    struct udp_client
+    {
+        boost::asio::ip::udp::endpoint endpoint;
+        mono_time last_seen;
+        // System IDs heard from this client
+        std::bitset<256> sysids;
+    };
+    std::vector<udp_client> clients;
+    // Sender of the datagram being received, and its index in clients
+    boost::asio::ip::udp::endpoint remote_endpoint_;
+    size_t current_client = 0;
+    int client_timeout_ms = MAV_PACKET_TIMEOUT_MS;
+    boost::asio::deadline_timer client_timer {io_service_};
+
+    // Finds or adds the client and makes it the current client
+    void clientSeen(const boost::asio::ip::udp::endpoint &from);
+    // Periodically drops clients which have gone quiet
+    void expireClients();
+    void handleClientTimer(const boost::system::error_code& error);
+    // Learns which systems are behind the current client
+    void onMessageRecv(const frame_ptr &frame) override;
+    // Forgets a timed out system, it may come back behind another client
+    void onSystemDead(uint8_t sysid) override;
+
+    // Datagrams per recvmmsg/sendmmsg, 1 when batching is off
+    int batch_size = 1;
+#ifdef ASYNCSOCKET_MMSG
+    // Receive side, one buffer and address per datagram in the batch
+    std::vector<uint8_t> batch_in;
+    std::vector<sockaddr_storage> batch_addrs;
+    std::vector<iovec> recv_iovs;
+    std::vector<mmsghdr> recv_hdrs;
+    // Send side, frames waiting for the next sendmmsg, how many
+    // consecutive frames make up each datagram and where each one goes
+    std::vector<frame_ptr> batch_out;
+    std::vector<size_t> batch_counts;
+    std::vector<boost::asio::ip::udp::endpoint> batch_dests;
+    std::vector<iovec> send_iovs;
+    std::vector<mmsghdr> send_hdrs;
+    // Set while waiting for the socket to become writable again
+    bool send_waiting = false;
+
+    void handleReadable(const boost::system::error_code& error);
+    void handleWritable(const boost::system::error_code& error);
+#endif
+
+    //takes a serialised frame and calls send
+    void processAndSend(const frame_ptr &frame) override;
+
+    //sends whatever processAndSend has batched up
+    void flushOutgoing() override;
 
-    //Actually sends
-    void send(uint8_t *buf, std::size_t buf_size);
+    //Actually sends, holds a reference to the frame until the send completes
+    void send(const frame_ptr &frame, const boost::asio::ip::udp::endpoint &dest);
     void receive(); //Starts a async receive
 
     void prep(const std::string& host, const std::string& hostport);
+    // Sets up batching, starts the receive and the io_service thread
+    void start();
+
+    // Sends frames back to back in one datagram to dest
+    void sendDatagram(const frame_ptr *frames, size_t count,
+                      const boost::asio::ip::udp::endpoint &dest);
+
+    // Frames waiting to be coalesced into the next datagram (coalesce_us)
+    std::vector<frame_ptr> coalesce_frames;
+    size_t coalesce_bytes = 0;
+    boost::asio::deadline_timer coalesce_timer {io_service_};
+    // Bumped on every flush so a stale timer callback can't flush early
+    unsigned int coalesce_generation = 0;
+    void flushCoalesced();
+    void handleCoalesceTimer(const boost::system::error_code& error, unsigned int generation);
 };
 
 #endif
@@ -1,7 +1,7 @@
 #include "configfile.h"
 
 #include <fstream>
-#include "../include/mavlink2/mavlink_get_info.h"
+#include "mavhelper.h"
 
 int readConfigFile(std::string &filename, std::vector<std::shared_ptr<mlink> > &links)
 {
@@ -16,6 +16,8 @@ int readConfigFile(std::string &filename, std::vector<std::shared_ptr<mlink> > &
         std::string type;
         bool isSerial = false;
         UDP_type udp_type_ = UDP_TYPE_NONE;
+        bool isTCP = false;
+        bool tcpserver = false;
         if(!_configFile.strValue(thisSection, "type", &type))
         {
             std::cerr << "Link has no type - skipping" << std::endl;
@@ -31,6 +33,7 @@ int readConfigFile(std::string &filename, std::vector<std::shared_ptr<mlink> > &
         int targetport = 0;
         int localport = 0;
         int bcastport = 0;
+        int client_timeout = MAV_PACKET_TIMEOUT_MS;
 
         if( type.compare("serial") == 0)
         {
@@ -97,6 +100,38 @@ int readConfigFile(std::string &filename, std::vector<std::shared_ptr<mlink> > &
                 std::cout << "Valid UDPBroadcast Link: " << thisSection << " Found, broadcasting on port " << bcastport << " bound to: " << bindip << std::endl;
             }
         }
+        else if(type.compare("udpserver") == 0)
+        {
+            if(!_configFile.intValue(thisSection, "localport", &localport))
+            {
+                std::cerr << "Link: " << thisSection << " is specified as udpserver but does not have a valid localport" << std::endl;
+                continue;
+            }
+            _configFile.intValue(thisSection, "client_timeout", &client_timeout);
+            udp_type_ = UDP_TYPE_MULTI_CLIENT;
+            std::cout << "Valid UDP Server Link: " << thisSection << " Found, listening on port " << localport << std::endl;
+        }
+        else if(type.compare("tcp") == 0)
+        {
+            if(!_configFile.strValue(thisSection, "targetip", &targetip) || !_configFile.intValue(thisSection, "targetport", &targetport))
+            {
+                std::cerr << "Link: " << thisSection << " is specified as tcp but does not have valid targetip and targetport" << std::endl;
+                continue;
+            }
+            isTCP = true;
+            std::cout << "Valid TCP Link: " << thisSection << " Found at " << targetip << ":" << targetport << std::endl;
+        }
+        else if(type.compare("tcpserver") == 0)
+        {
+            if(!_configFile.intValue(thisSection, "localport", &localport))
+            {
+                std::cerr << "Link: " << thisSection << " is specified as tcpserver but does not have a valid localport" << std::endl;
+                continue;
+            }
+            isTCP = true;
+            tcpserver = true;
+            std::cout << "Valid TCP Server Link: " << thisSection << " Found, listening on port " << localport << std::endl;
+        }
         else
         {
             std::cerr << "Link: " << thisSection << " has invalid link type: " << type << std::endl;
@@ -113,6 +148,20 @@ int readConfigFile(std::string &filename, std::vector<std::shared_ptr<mlink> > &
                                                    ,flowcontrol
                                                    ,_info)));
         }
+        else if(isTCP)
+        {
+            if(tcpserver)
+            {
+                links.push_back(std::shared_ptr<mlink>(new tcplink(std::to_string(localport)
+                                                       ,_info)));
+            }
+            else
+            {
+                links.push_back(std::shared_ptr<mlink>(new tcplink(targetip
+                                                       ,std::to_string(targetport)
+                                                       ,_info)));
+            }
+        }
         else if (udp_type_ != UDP_TYPE_NONE)
         {
             switch(udp_type_)
@@ -143,6 +192,12 @@ int readConfigFile(std::string &filename, std::vector<std::shared_ptr<mlink> > &
                                            std::to_string(bcastport)
                                            ,_info)));
                 break;
+            case UDP_TYPE_MULTI_CLIENT:
+                links.push_back(
+                    std::shared_ptr<mlink>(new asyncsocket(std::to_string(localport),
+                                           client_timeout
+                                           ,_info)));
+                break;
             }
         }
     }
@@ -191,6 +246,157 @@ void readLinkInfo(ConfigFile* _configFile, std::string thisSection, link_info* _
     // Enable sleep mode for the link
     _configFile->boolValue(thisSection, "sleep", &_info->sleep_enabled);
 
+    // Every link forwards received frames untouched now
+    std::string passthrough_str;
+    if (_configFile->strValue(thisSection, "passthrough", &passthrough_str))
+    {
+        std::cout << "WARNING: passthrough on \"" << _info->link_name
+                  << "\" is deprecated and ignored, every link forwards packets untouched" << std::endl;
+    }
+
+    // Move several datagrams per system call on UDP links
+    _configFile->intValue(thisSection, "udp_batch", &_info->udp_batch);
+
+    // Pack several frames into each UDP datagram
+    _configFile->intValue(thisSection, "coalesce_us", &_info->coalesce_us);
+    _configFile->intValue(thisSection, "coalesce_max_bytes", &_info->coalesce_max_bytes);
+
+    // How far a TCP peer may fall behind before its packets are dropped
+    _configFile->intValue(thisSection, "tcp_max_pending", &_info->tcp_max_pending_bytes);
+
+    // How much a link may have queued or waiting to be written
+    _configFile->intValue(thisSection, "max_backlog", &_info->max_backlog);
+
+    // Serial latency tuning
+    _configFile->boolValue(thisSection, "low_latency", &_info->low_latency);
+
+    // asio reads a non-blocking port as soon as it is readable, so the
+    // termios read thresholds never applied
+    std::string threshold_str;
+    if (_configFile->strValue(thisSection, "vmin", &threshold_str) ||
+            _configFile->strValue(thisSection, "vtime", &threshold_str))
+    {
+        std::cout << "WARNING: vmin and vtime on \"" << _info->link_name
+                  << "\" are ignored, they have no effect on a non-blocking port" << std::endl;
+    }
+
+    // Output rate limits, MESSAGE:hz pairs
+    std::string rate_limit_string;
+    if (_configFile->strValue(thisSection, "rate_limit", &rate_limit_string))
+    {
+        std::vector<std::string> limit_strs;
+        boost::split(limit_strs, rate_limit_string, boost::is_any_of(","));
+
+        for (const std::string &limit_str : limit_strs)
+        {
+            size_t separator = limit_str.find_first_of(':');
+            if (separator == std::string::npos)
+            {
+                std::cout << "Failed to add rate limit \"" << limit_str << "\" on \"" << _info->link_name
+                          << "\". Expected MESSAGE:hz!" << std::endl;
+                continue;
+            }
+
+            std::string message_str = limit_str.substr(0, separator);
+            const mavlink_message_info_t *message_info = messageInfoByName(message_str.c_str());
+            if (!message_info)
+            {
+                std::cout << "Failed to add rate limit for message \"" << message_str << "\". Unknown message!" << std::endl;
+                continue;
+            }
+
+            float hz = atof(limit_str.substr(separator + 1).c_str());
+            if (hz <= 0)
+            {
+                std::cout << "Failed to add rate limit for message \"" << message_str << "\". Rate must be above 0!" << std::endl;
+                continue;
+            }
+
+            _info->rate_limits[message_info->msgid] = hz;
+        }
+    }
+
+    // Outgoing traffic classes, MESSAGE:class pairs on top of the defaults
+    std::string priority_string;
+    if (_configFile->strValue(thisSection, "priority", &priority_string))
+    {
+        std::vector<std::string> priority_strs;
+        boost::split(priority_strs, priority_string, boost::is_any_of(","));
+
+        for (const std::string &priority_str : priority_strs)
+        {
+            size_t separator = priority_str.find_first_of(':');
+            if (separator == std::string::npos)
+            {
+                std::cout << "Failed to set priority \"" << priority_str << "\" on \"" << _info->link_name
+                          << "\". Expected MESSAGE:class!" << std::endl;
+                continue;
+            }
+
+            std::string message_str = priority_str.substr(0, separator);
+            const mavlink_message_info_t *message_info = messageInfoByName(message_str.c_str());
+            if (!message_info)
+            {
+                std::cout << "Failed to set priority for message \"" << message_str << "\". Unknown message!" << std::endl;
+                continue;
+            }
+
+            traffic_class tclass;
+            std::string class_str = priority_str.substr(separator + 1);
+            if (!parseTrafficClass(class_str, tclass))
+            {
+                std::cout << "Failed to set priority for message \"" << message_str << "\". Unknown class \""
+                          << class_str << "\", expected control, heartbeat, telemetry or bulk!" << std::endl;
+                continue;
+            }
+
+            _info->priority_classes[message_info->msgid] = tclass;
+        }
+    }
+
+    // Share the link between the traffic classes instead of strict priority
+    std::string weights_string;
+    if (_configFile->strValue(thisSection, "priority_weights", &weights_string))
+    {
+        std::vector<std::string> weight_strs;
+        boost::split(weight_strs, weights_string, boost::is_any_of(","));
+
+        std::vector<int> weights;
+        for (const std::string &weight_str : weight_strs)
+            weights.push_back(atoi(weight_str.c_str()));
+
+        if (weights.size() != TRAFFIC_CLASSES ||
+                *std::min_element(weights.begin(), weights.end()) <= 0)
+        {
+            std::cout << "Failed to set priority weights on \"" << _info->link_name
+                      << "\". Expected " << TRAFFIC_CLASSES << " weights above 0, using strict priority!" << std::endl;
+        }
+        else
+        {
+            _info->priority_weights = weights;
+        }
+    }
+
+    // Messages where only the newest unsent sample of each stream is kept
+    std::string latest_only_string;
+    if (_configFile->strValue(thisSection, "latest_only", &latest_only_string))
+    {
+        std::vector<std::string> message_strs;
+        boost::split(message_strs, latest_only_string, boost::is_any_of(","));
+
+        for (const std::string &message_str : message_strs)
+        {
+            const mavlink_message_info_t *message_info = messageInfoByName(message_str.c_str());
+            if (!message_info)
+            {
+                std::cout << "Failed to add message \"" << message_str << "\" to latest_only. Unknown message!" << std::endl;
+                continue;
+            }
+
+            _info->latest_only.insert(message_info->msgid);
+        }
+    }
+
     //Message Filters
     std::string filter_string;
     if (_configFile->strValue(thisSection, "filter", &filter_string))
@@ -233,7 +439,7 @@ void readLinkInfo(ConfigFile* _configFile, std::string thisSection, link_info* _
                     // For every message name
                     for (const std::string &filter_message_str : messages_strs) {
                         // Find the MAVLink message information
-                        message_info = mavlink_get_message_info_by_name(filter_message_str.c_str());
+                        message_info = messageInfoByName(filter_message_str.c_str());
 
                         // Valid message name
                         if (message_info)
@@ -10,6 +10,7 @@
 #include "mlink.h"
 #include "serial.h"
 #include "asyncsocket.h"
+#include "tcplink.h"
 
 class ConfigFile
 {
@@ -32,6 +33,6 @@ public:
 void readLinkInfo(ConfigFile* _configFile, std::string thisSection, link_info* _info);
 int readConfigFile(std::string &filename, std::vector<std::shared_ptr<mlink> > &links);
 
-enum UDP_type {UDP_TYPE_NONE, UDP_TYPE_FULLY_SPECIFIED, UDP_TYPE_SERVER, UDP_TYPE_CLIENT, UDP_TYPE_BROADCAST};
+enum UDP_type {UDP_TYPE_NONE, UDP_TYPE_FULLY_SPECIFIED, UDP_TYPE_SERVER, UDP_TYPE_CLIENT, UDP_TYPE_BROADCAST, UDP_TYPE_MULTI_CLIENT};
 
 #endif
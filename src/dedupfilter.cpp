@@ -0,0 +1,155 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * DUPLICATE FILTER CLASS
+ * Remembers a 64 bit hash of every recent packet (sysid, compid, seq, msgid
+ * and payload) so the same packet arriving over a second link can be dropped.
+ * The hash multiplies in eight bytes at a time and finishes with MurmurHash3's
+ * 64 bit mix. Hashes are kept in time buckets: a packet is a repeat if its
+ * hash is in any bucket inside the window, and a bucket is emptied when it
+ * is reused by clearing just the slots it filled, so nothing ever sweeps the
+ * table. The filter is split into shards by hash, each with its own lock, so
+ * links rarely wait on each other.
+ */
+
+#include "dedupfilter.h"
+
+#include <algorithm>
+#include <cstring>
+
+bool dedupfilter::insert(uint64_t hash, mono_time now)
+{
+    if (hash == 0)
+        hash = 1;
+
+    int64_t epoch = now / ((mono_time)DEDUP_BUCKET_MS * MONO_US_PER_MS);
+
+    // Top bits pick the shard, the bottom bits are used inside the buckets
+    shard &s = shards[hash >> 60];
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    int window = window_buckets.load(std::memory_order_relaxed);
+    for (int i = 0; i <= window && i <= epoch; i++)
+    {
+        const bucket &b = s.buckets[(epoch - i) % DEDUP_BUCKETS];
+        // A bucket left over from an older period has expired
+        if (b.epoch == epoch - i && b.contains(hash))
+            return false;
+    }
+
+    bucket &current = s.buckets[epoch % DEDUP_BUCKETS];
+    if (current.epoch != epoch)
+        current.reset(epoch);
+    current.add(hash);
+    return true;
+}
+
+void dedupfilter::setWindow(long window_ms)
+{
+    window_ms = std::max(window_ms, (long)DEDUP_MIN_WINDOW_MS);
+    int buckets = (window_ms + DEDUP_BUCKET_MS - 1) / DEDUP_BUCKET_MS;
+    window_buckets.store(std::min(buckets, DEDUP_BUCKETS - 1), std::memory_order_relaxed);
+}
+
+uint64_t dedupfilter::hashFrame(const mavframe &frame)
+{
+    // seq, sysid, compid, msgid and the payload sit next to each other on
+    // the wire in both MAVLink1 and MAVLink2, so hash them straight from
+    // the received bytes
+    const uint8_t *start = frame.data + (frame.magic == MAVLINK_STX ? 4 : 2);
+    const uint8_t *end = frame.payload() + frame.payload_len;
+
+    // Eight bytes at a time, which costs a fraction of a byte wise hash
+    // even in an unoptimised build
+    uint64_t hash = end - start;
+    const uint8_t *byte = start;
+    for (; end - byte >= 8; byte += 8)
+    {
+        uint64_t word;
+        memcpy(&word, byte, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    for (; byte < end; byte++)
+        tail = (tail << 8) | *byte;
+    hash = (hash ^ tail) * 0x9E3779B97F4A7C15ULL;
+
+    // Final mix (MurmurHash3's), the shard comes from the top bits and
+    // slots from the bottom ones so both have to depend on every byte
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+bool dedupfilter::bucket::contains(uint64_t hash) const
+{
+    if (slots.empty())
+        return false;
+
+    // Plain pointers, the probe loop runs for every bucket in the window
+    const uint64_t *slot = slots.data();
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask; slot[i] != 0; i = (i + 1) & mask)
+    {
+        if (slot[i] == hash)
+            return true;
+    }
+    return false;
+}
+
+void dedupfilter::bucket::add(uint64_t hash)
+{
+    // Keep the table at most half full so probes stay short
+    if ((count + 1) * 2 > slots.size())
+    {
+        std::vector<uint64_t> old;
+        old.swap(slots);
+        slots.assign(std::max<size_t>(DEDUP_MIN_SLOTS, old.size() * 2), 0);
+        used.resize(slots.size() / 2);
+        count = 0;
+        for (auto entry = old.begin(); entry != old.end(); ++entry)
+        {
+            if (*entry != 0)
+                add(*entry);
+        }
+    }
+
+    uint64_t *slot = slots.data();
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    while (slot[i] != 0 && slot[i] != hash)
+        i = (i + 1) & mask;
+    if (slot[i] == 0)
+    {
+        slot[i] = hash;
+        used.data()[count++] = i;
+    }
+}
+
+void dedupfilter::bucket::reset(int64_t new_epoch)
+{
+    epoch = new_epoch;
+
+    // After a burst, give back what the last period didn't need rather
+    // than keep a table sized for the peak
+    if (slots.size() > DEDUP_MIN_SLOTS && count * 8 < slots.size())
+    {
+        size_t size = DEDUP_MIN_SLOTS;
+        while (size < count * 4)
+            size *= 2;
+        std::vector<uint64_t>(size, 0).swap(slots);
+        std::vector<uint32_t>(size / 2).swap(used);
+        count = 0;
+        return;
+    }
+
+    uint64_t *slot = slots.data();
+    const uint32_t *index = used.data();
+    for (size_t i = 0; i < count; i++)
+        slot[index[i]] = 0;
+    count = 0;
+}
@@ -0,0 +1,76 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * DUPLICATE FILTER CLASS
+ * Remembers a 64 bit hash of every recent packet (sysid, compid, seq, msgid
+ * and payload) so the same packet arriving over a second link can be dropped.
+ * The hash multiplies in eight bytes at a time and finishes with MurmurHash3's
+ * 64 bit mix. Hashes are kept in time buckets: a packet is a repeat if its
+ * hash is in any bucket inside the window, and a bucket is emptied when it
+ * is reused by clearing just the slots it filled, so nothing ever sweeps the
+ * table. The filter is split into shards by hash, each with its own lock, so
+ * links rarely wait on each other.
+ */
+#ifndef DEDUPFILTER_H
+#define DEDUPFILTER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "mavframe.h"
+#include "monoclock.h"
+
+#define DEDUP_SHARDS 16
+#define DEDUP_BUCKET_MS 250
+// The longest window is DEDUP_BUCKETS - 1 buckets
+#define DEDUP_BUCKETS 64
+#define DEDUP_MIN_WINDOW_MS 1000
+// Smallest table a bucket keeps, a power of two
+#define DEDUP_MIN_SLOTS 64
+
+class dedupfilter
+{
+public:
+    // Records the hash as seen at now, returns false if it was already seen
+    // inside the window
+    bool insert(uint64_t hash, mono_time now);
+
+    // How long packets are remembered for, never less than DEDUP_MIN_WINDOW_MS
+    void setWindow(long window_ms);
+
+    // Hash of the parts of a frame which are the same on every link it arrives on
+    static uint64_t hashFrame(const mavframe &frame);
+
+private:
+    // Open addressing hash set, zero marks an empty slot
+    struct bucket
+    {
+        // Which DEDUP_BUCKET_MS period the bucket holds, -1 when unused
+        int64_t epoch = -1;
+        std::vector<uint64_t> slots;
+        // Indexes of the count filled slots, so emptying the bucket only
+        // touches those rather than every slot a past burst grew it to
+        std::vector<uint32_t> used;
+        size_t count = 0;
+
+        bool contains(uint64_t hash) const;
+        void add(uint64_t hash);
+        void reset(int64_t new_epoch);
+    };
+
+    // Own cache line so shards locked by different links don't contend
+    struct alignas(64) shard
+    {
+        std::mutex mutex;
+        bucket buckets[DEDUP_BUCKETS];
+    };
+
+    shard shards[DEDUP_SHARDS];
+
+    // Buckets before the current one that are still inside the window
+    std::atomic<int> window_buckets {DEDUP_MIN_WINDOW_MS / DEDUP_BUCKET_MS};
+};
+
+#endif
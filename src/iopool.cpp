@@ -0,0 +1,31 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * IO POOL CLASS
+ * A single io_service run by a fixed number of threads. When enabled every
+ * link runs its I/O on the pool (see mlink::shared_io_service) instead of
+ * owning a thread each, so the thread count no longer grows with the links.
+ */
+
+#include "iopool.h"
+
+iopool::iopool(int num_threads)
+{
+    work.reset(new boost::asio::io_service::work(io_service));
+    for (int i = 0; i < num_threads; i++)
+    {
+        threads.create_thread([this] { io_service.run(); });
+    }
+}
+
+iopool::~iopool()
+{
+    stop();
+}
+
+void iopool::stop()
+{
+    work.reset();
+    io_service.stop();
+    threads.join_all();
+}
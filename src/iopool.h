@@ -0,0 +1,34 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * IO POOL CLASS
+ * A single io_service run by a fixed number of threads. When enabled every
+ * link runs its I/O on the pool (see mlink::shared_io_service) instead of
+ * owning a thread each, so the thread count no longer grows with the links.
+ */
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <memory>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+class iopool
+{
+public:
+    iopool(int num_threads);
+    ~iopool();
+
+    // Stops and joins the threads, anything still queued is never run.
+    // Must be called before the links using the pool are destroyed
+    void stop();
+
+    boost::asio::io_service io_service;
+
+private:
+    // Keeps run() from returning while the links are idle
+    std::unique_ptr<boost::asio::io_service::work> work;
+    boost::thread_group threads;
+};
+
+#endif
@@ -0,0 +1,91 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * LATENCY HISTOGRAM CLASS
+ * Counts durations in log-linear buckets, in the style of an HDR histogram:
+ * each power of two range of microseconds is split into 16 equal buckets, so
+ * any recorded value is known to within about 6% from 1 us up to about a
+ * minute with a few hundred counters. Recording is one bucket calculation and
+ * a relaxed store, made by a single thread; any thread can read percentiles.
+ */
+
+#include "latencyhistogram.h"
+
+#include <algorithm>
+
+void latencyhistogram::record(mono_time us)
+{
+    if (us < 0)
+        us = 0;
+
+    // Single writer, so plain loads and stores are enough
+    std::atomic<uint64_t> &bucket = counts[bucketFor(us)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    total_us.store(total_us.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+    if (us > largest.load(std::memory_order_relaxed))
+        largest.store(us, std::memory_order_relaxed);
+}
+
+mono_time latencyhistogram::percentile(double fraction) const
+{
+    // Counts keep moving while this runs, so total them here rather than
+    // trusting total to match
+    uint64_t snapshot[LATENCY_BUCKETS];
+    uint64_t recorded = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        snapshot[i] = counts[i].load(std::memory_order_relaxed);
+        recorded += snapshot[i];
+    }
+    if (recorded == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(fraction * recorded);
+    if (rank >= recorded)
+        rank = recorded - 1;
+
+    // A bucket can reach past anything actually recorded. The top one has
+    // no upper bound, everything from 2^LATENCY_MAX_BITS up lands there
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++)
+    {
+        seen += snapshot[i];
+        if (seen > rank)
+            return std::min(bucketUpperBound(i), max());
+    }
+    return max();
+}
+
+uint64_t latencyhistogram::countAtMost(mono_time limit) const
+{
+    uint64_t at_most = 0;
+    // The top bucket has no upper bound, so it is never known to be at most limit
+    for (int i = 0; i < LATENCY_BUCKETS - 1 && bucketUpperBound(i) <= limit; i++)
+        at_most += counts[i].load(std::memory_order_relaxed);
+    return at_most;
+}
+
+int latencyhistogram::bucketFor(mono_time us)
+{
+    if (us < LATENCY_SUB_COUNT)
+        return (int)us;
+    if (us >= ((mono_time)1 << LATENCY_MAX_BITS))
+        return LATENCY_BUCKETS - 1;
+
+    // Keep the top LATENCY_SUB_BITS bits of the value, the position of the
+    // highest bit picks the range and the rest pick the bucket within it
+    int msb = 63 - __builtin_clzll((unsigned long long)us);
+    int shift = msb - (LATENCY_SUB_BITS - 1);
+    return (shift + 1) * LATENCY_HALF_COUNT + (int)((us >> shift) - LATENCY_HALF_COUNT);
+}
+
+mono_time latencyhistogram::bucketUpperBound(int bucket)
+{
+    if (bucket < LATENCY_SUB_COUNT)
+        return bucket;
+
+    int shift = bucket / LATENCY_HALF_COUNT - 1;
+    mono_time lowest = (mono_time)(LATENCY_HALF_COUNT + bucket % LATENCY_HALF_COUNT) << shift;
+    return lowest + ((mono_time)1 << shift) - 1;
+}
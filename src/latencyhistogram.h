@@ -0,0 +1,67 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * LATENCY HISTOGRAM CLASS
+ * Counts durations in log-linear buckets, in the style of an HDR histogram:
+ * each power of two range of microseconds is split into 16 equal buckets, so
+ * any recorded value is known to within about 6% from 1 us up to about a
+ * minute with a few hundred counters. Recording is one bucket calculation and
+ * a relaxed store, made by a single thread; any thread can read percentiles.
+ */
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "monoclock.h"
+
+// Values below 2^LATENCY_SUB_BITS us get a bucket each
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_HALF_COUNT (LATENCY_SUB_COUNT / 2)
+// Anything at or above 2^LATENCY_MAX_BITS us (~67 s) goes in one extra bucket
+#define LATENCY_MAX_BITS 26
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) * LATENCY_HALF_COUNT + 1)
+
+class latencyhistogram
+{
+public:
+    // Only one thread may record into a histogram
+    void record(mono_time us);
+
+    // Upper bound of the bucket holding the given fraction (0-1) of values,
+    // 0 if nothing has been recorded
+    mono_time percentile(double fraction) const;
+
+    long count() const
+    {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    mono_time max() const
+    {
+        return largest.load(std::memory_order_relaxed);
+    }
+
+    // Total of every value recorded
+    mono_time sum() const
+    {
+        return total_us.load(std::memory_order_relaxed);
+    }
+
+    // Values recorded at or below limit. Exact when limit is one less than a
+    // power of two, otherwise rounded down to a bucket boundary
+    uint64_t countAtMost(mono_time limit) const;
+
+private:
+    std::atomic<uint64_t> counts[LATENCY_BUCKETS] {};
+    std::atomic<long> total {0};
+    std::atomic<mono_time> largest {0};
+    std::atomic<mono_time> total_us {0};
+
+    static int bucketFor(mono_time us);
+    static mono_time bucketUpperBound(int bucket);
+};
+
+#endif
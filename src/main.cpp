@@ -20,14 +20,19 @@
 #include "shell.h"
 #include "configfile.h"
 #include "mavhelper.h"
+#include "routingtable.h"
+#include "iopool.h"
+#include "metricsserver.h"
 
 //Periodic function timings
-#define MAIN_LOOP_SLEEP_QUEUE_EMPTY_MS 10
+//The main loop is woken by incoming packets, this only bounds how long
+//housekeeping (routing updates and sleep mode checks) can be delayed when idle
+#define MAIN_LOOP_WAIT_TIMEOUT_MS 100
 
 // Functions in this file
-boost::program_options::options_description add_program_options(std::string &filename, bool &shellen, bool &verbose);
+boost::program_options::options_description add_program_options(std::string &filename, bool &shellen, bool &verbose, int &spin_us, int &io_threads, int &metrics_port);
 int try_user_options(int argc, char** argv, boost::program_options::options_description desc);
-void runMainLoop(std::vector<std::shared_ptr<mlink> > *links, bool &verbose);
+void runMainLoop(std::vector<std::shared_ptr<mlink> > *links, routingtable *routes, bool &verbose, int spin_us);
 void exitGracefully(int a);
 
 bool exitMainLoop = false;
@@ -35,14 +40,19 @@ bool exitMainLoop = false;
 int main(int argc, char** argv)
 {
     signal(SIGINT, exitGracefully);
+    // Optional shared I/O threads, declared first so they outlive the links
+    std::unique_ptr<iopool> pool;
     // Keep track of all known links
     std::vector<std::shared_ptr<mlink> > links;
     // Default mode selections
     bool shellen = true;
     bool verbose = false;
+    int spin_us = 0;
+    int io_threads = 0;
+    int metrics_port = 0;
 
     std::string filename;
-    boost::program_options::options_description desc = add_program_options(filename, shellen, verbose);
+    boost::program_options::options_description desc = add_program_options(filename, shellen, verbose, spin_us, io_threads, metrics_port);
 
     int ret = try_user_options(argc, argv, desc);
     if (ret == 1)
@@ -50,6 +60,13 @@ int main(int argc, char** argv)
     else if (ret == -1)
         return 0; // Help option
 
+    // Links pick up the pool when they are constructed
+    if (io_threads > 0)
+    {
+        pool.reset(new iopool(io_threads));
+        mlink::shared_io_service = &pool->io_service;
+    }
+
     ret = readConfigFile(filename, links);
     if (links.size() == 0)
     {
@@ -64,6 +81,25 @@ int main(int argc, char** argv)
     for (uint16_t i = 0; i != links.size(); ++i)
     {
         links.at(i)->link_id = i;
+        links.at(i)->setupLatency(links.size());
+    }
+
+    // Routing state is built from the numbered links
+    routingtable routes(&links);
+
+    // Optional metrics endpoint, stopped before the links go away
+    std::unique_ptr<metricsserver> metrics;
+    if (metrics_port > 0)
+    {
+        try
+        {
+            metrics.reset(new metricsserver(metrics_port, &links));
+            std::cout << "Serving metrics on http://localhost:" << metrics_port << "/metrics" << std::endl;
+        }
+        catch (boost::system::system_error &e)
+        {
+            std::cerr << "Metrics server failed to start: " << e.what() << std::endl;
+        }
     }
 
     // Run the shell thread
@@ -77,26 +113,34 @@ int main(int argc, char** argv)
     // Start the main loop
     while (!exitMainLoop)
     {
-        runMainLoop(&links, verbose);
+        runMainLoop(&links, &routes, verbose, spin_us);
     }
 
     // Once the main loop is done, rejoin the shell thread
     if (shellen)
         shell.join();
 
+    // No link handlers or scrapes may run once the links start being destroyed
+    metrics.reset();
+    if (pool)
+        pool->stop();
+
     // Report successful exit from main()
     std::cout << "Links deallocated, stack unwound, exiting." << std::endl;
     return 0;
 }
 
-boost::program_options::options_description add_program_options(std::string &filename, bool &shellen, bool &verbose)
+boost::program_options::options_description add_program_options(std::string &filename, bool &shellen, bool &verbose, int &spin_us, int &io_threads, int &metrics_port)
 {
     boost::program_options::options_description desc("Options");
     desc.add_options()
     ("help", "Print help messages")
     ("file,f", boost::program_options::value<std::string>(&filename), "configuration file, usage: --file=path/to/file.conf")
     ("interface,i", boost::program_options::bool_switch(&shellen), "start in interactive mode with cmav shell")
-    ("verbose,v", boost::program_options::bool_switch(&verbose), "verbose output including dropped packets");
+    ("verbose,v", boost::program_options::bool_switch(&verbose), "verbose output including dropped packets")
+    ("spin,s", boost::program_options::value<int>(&spin_us), "low latency mode, busy wait this many microseconds for new packets before blocking")
+    ("threads,t", boost::program_options::value<int>(&io_threads), "run all links on one shared pool of this many I/O threads instead of a thread per link")
+    ("metrics,m", boost::program_options::value<int>(&metrics_port), "serve Prometheus metrics over HTTP on this port on localhost");
     return desc;
 }
 
@@ -147,150 +191,57 @@ int try_user_options(int argc, char** argv, boost::program_options::options_desc
 
 }
 
-bool should_forward_message(mavlink_message_t &msg, std::shared_ptr<mlink> *incoming_link, std::shared_ptr<mlink> *outgoing_link)
+void runMainLoop(std::vector<std::shared_ptr<mlink> > *links, routingtable *routes, bool &verbose, int spin_us)
 {
+    // Gets run in a while loop once links are setup
 
-    // If the packet came from this link, don't bother
-    if (outgoing_link == incoming_link)
-    {
-        return false;
-    }
-
-    // Sleep mode enabled for this link and the link is sleeping
-    if (((*outgoing_link)->info.sleep_enabled) && ((*outgoing_link)->sleep))
-        return false;
-
-    // Filter is presented
-    if ((*outgoing_link)->info.filter_type != link_filter_type::NONE)
-    {
-        // The current message type is in the filter messages set
-        bool message_found = (*outgoing_link)->info.filter_messages.find(msg.msgid) != (*outgoing_link)->info.filter_messages.end();
-
-        if (message_found && ((*outgoing_link)->info.filter_type == link_filter_type::DROP) ||
-                (!message_found && ((*outgoing_link)->info.filter_type == link_filter_type::ACCEPT)))
-            return false;
-    }
-
-    // Don't forward SiK radio info
-    if ((*incoming_link)->info.SiK_radio && msg.sysid == 51)
-    {
-        return false;
-    }
-
-    // If the current link being checked is designated to receive
-    // from a non-zero system ID and that system ID isn't present on
-    // this link, don't send on this link.
-    if ((*outgoing_link)->info.output_only_from[0] != 0 &&
-            std::find((*outgoing_link)->info.output_only_from.begin(),
-                      (*outgoing_link)->info.output_only_from.end(),
-                      msg.sysid) == (*outgoing_link)->info.output_only_from.end())
-    {
-        return false;
-    }
-
-    // heartbeats are always forwarded
-    if (msg.msgid == MAVLINK_MSG_ID_HEARTBEAT)
-    {
-        return true;
-    }
-
-    int16_t sysIDmsg = -1;
-    int16_t compIDmsg = -1;
-    getTargets(&msg, sysIDmsg, compIDmsg);
-    if (sysIDmsg == -1)
-    {
-        return true;
-    }
-    if (compIDmsg == -1)
-    {
-        return true;
-    }
-    if (sysIDmsg == 0)
-    {
-        return true;
-    }
-
-    // if we get this far then the packet is routable; if we can't
-    // find a route for it then we drop the message.
-    if (!((*outgoing_link)->seenSysID(sysIDmsg)))
-    {
-        return false;
-    }
-
-    // TODO: should check sysid/compid combination has been seen, not
-    // just sysid
-
-    return true;
-}
+    // Learn and expire systems, pick up link state changes
+    routes->update();
 
-void runMainLoop(std::vector<std::shared_ptr<mlink> > *links, bool &verbose)
-{
-    // Gets run in a while loop once links are setup
+    // Reused between packets so routing doesn't allocate
+    static boost::dynamic_bitset<> send_mask;
+    static boost::dynamic_bitset<> down_mask;
 
     // Iterate through each link
-    mavlink_message_t msg;
+    frame_ptr frame;
     bool should_sleep = true;
     for (auto incoming_link = links->begin(); incoming_link != links->end(); ++incoming_link)
     {
-        // Clear out dead links
-        (*incoming_link)->checkForDeadSysID();
-
-        // Sleep mode enabled for this link
-        if ((*incoming_link)->info.sleep_enabled)
-        {
-            // There are clients on the link, sleep mode enabled
-            if ((*incoming_link)->sysID_stats.size() && ((*incoming_link)->sleep))
-            {
-                std::cout << "Sleep mode disabled on link: " << (*incoming_link)->info.link_name << std::endl;
-                (*incoming_link)->sleep = false;
-            }
-            // There are no clients on the link, sleep mode disabled
-            else if (!(*incoming_link)->sysID_stats.size() && !((*incoming_link)->sleep))
-            {
-                std::cout << "Sleep mode enabled on link: " << (*incoming_link)->info.link_name << std::endl;
-                (*incoming_link)->sleep = true;
-            }
-        }
-
         // Try to read from the buffer for this link
-        while ((*incoming_link)->qReadIncoming(&msg))
+        while ((*incoming_link)->qReadIncoming(&frame))
         {
             should_sleep = false;
-            // Determine the correct target system ID for this message
-            int16_t sysIDmsg = -1;
-            int16_t compIDmsg = -1;
-            getTargets(&msg, sysIDmsg, compIDmsg);
 
+            // Outgoing links record latency by the link the frame came from
+            frame->ingress_link = (*incoming_link)->link_id;
+
+            // mavlink routing.  See comment in MAVLink_routing.cpp
+            // for logic
+            routes->route(*frame, **incoming_link, send_mask, down_mask);
+
+            // The frame is shared between every link it routes to
+            for (size_t i = send_mask.find_first(); i != boost::dynamic_bitset<>::npos; i = send_mask.find_next(i))
+            {
+                links->at(i)->qAddOutgoing(frame);
+            }
 
-            // Iterate through each link to send to the correct target
-            for (auto outgoing_link = links->begin(); outgoing_link != links->end(); ++outgoing_link)
+            if (verbose && down_mask.any())
             {
-                // mavlink routing.  See comment in MAVLink_routing.cpp
-                // for logic
-                if (!should_forward_message(msg, &(*incoming_link), &(*outgoing_link)))
-                {
-                    continue;
-                }
-
-                // Provided nothing else has failed and the link is up, add the
-                // message to the outgoing queue.
-                if ((*outgoing_link)->up)
-                {
-                    (*outgoing_link)->qAddOutgoing(msg);
-                }
-                else if (verbose)
-                {
-                    std::cout << "Packet dropped from sysID: " << (int)msg.sysid
-                              << " msgID: " << (int)msg.msgid
-                              << " target system: " << (int)sysIDmsg
-                              << " link name: " << (*incoming_link)->info.link_name << std::endl;
-                }
+                // Determine the correct target system ID for this message
+                int16_t sysIDmsg = -1;
+                int16_t compIDmsg = -1;
+                getTargets(*frame, sysIDmsg, compIDmsg);
+                std::cout << "Packet dropped from sysID: " << (int)frame->sysid
+                          << " msgID: " << (int)frame->msgid
+                          << " target system: " << (int)sysIDmsg
+                          << " link name: " << (*incoming_link)->info.link_name << std::endl;
             }
         }
     }
     if (should_sleep)
     {
-        boost::this_thread::sleep(boost::posix_time::milliseconds(MAIN_LOOP_SLEEP_QUEUE_EMPTY_MS));
+        // Block until a link queues a packet
+        mlink::incoming_notifier.wait(spin_us, std::chrono::milliseconds(MAIN_LOOP_WAIT_TIMEOUT_MS));
     }
 }
 
@@ -0,0 +1,90 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * FRAME CLASS
+ * A MAVLink packet in its on the wire form. A packet is serialised into a
+ * frame once and the same frame is then queued on every link it is routed
+ * to, so fanning out to N links copies a pointer N times rather than the
+ * whole message. Frames are reference counted and recycled through a lock
+ * free pool, so the hot path doesn't touch the heap.
+ */
+
+#include "mavframe.h"
+
+#include <boost/lockfree/stack.hpp>
+
+namespace
+{
+// Frames are allocated by the main loop and released by whichever link
+// thread sends them last, so the free list has to be multi producer
+class framepool
+{
+public:
+    ~framepool()
+    {
+        mavframe *frame;
+        while (free_frames.pop(frame))
+            delete frame;
+    }
+
+    mavframe *get()
+    {
+        mavframe *frame;
+        if (free_frames.pop(frame))
+            return frame;
+        return new mavframe;
+    }
+
+    void put(mavframe *frame)
+    {
+        // Keep at most MAV_FRAME_POOL_SIZE frames around
+        if (!free_frames.bounded_push(frame))
+            delete frame;
+    }
+
+private:
+    boost::lockfree::stack<mavframe *, boost::lockfree::capacity<MAV_FRAME_POOL_SIZE> > free_frames;
+};
+
+framepool pool;
+}
+
+void mavframe::parseHeader()
+{
+    magic = data[0];
+    payload_len = data[1];
+    if (magic == MAVLINK_STX)
+    {
+        incompat_flags = data[2];
+        seq = data[4];
+        sysid = data[5];
+        compid = data[6];
+        msgid = data[7] | (data[8] << 8) | (data[9] << 16);
+    }
+    else
+    {
+        incompat_flags = 0;
+        seq = data[2];
+        sysid = data[3];
+        compid = data[4];
+        msgid = data[5];
+    }
+}
+
+frame_ptr mavframe::alloc()
+{
+    mavframe *frame = pool.get();
+    frame->len = 0;
+    return frame_ptr(frame);
+}
+
+void intrusive_ptr_add_ref(mavframe *frame)
+{
+    frame->refcount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void intrusive_ptr_release(mavframe *frame)
+{
+    if (frame->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        pool.put(frame);
+}
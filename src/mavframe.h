@@ -0,0 +1,71 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * FRAME CLASS
+ * A MAVLink packet in its on the wire form. A packet is serialised into a
+ * frame once and the same frame is then queued on every link it is routed
+ * to, so fanning out to N links copies a pointer N times rather than the
+ * whole message. Frames are reference counted and recycled through a lock
+ * free pool, so the hot path doesn't touch the heap.
+ */
+#ifndef MAVFRAME_H
+#define MAVFRAME_H
+
+#include <atomic>
+#include <boost/intrusive_ptr.hpp>
+#include "../include/mavlink2/ardupilotmega/mavlink.h"
+#include "monoclock.h"
+
+#define MAV_FRAME_POOL_SIZE 4096
+
+struct mavframe;
+typedef boost::intrusive_ptr<mavframe> frame_ptr;
+
+struct mavframe
+{
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    uint16_t len = 0;
+
+    // Header fields, filled in from data by parseHeader()
+    uint8_t magic = 0;
+    uint8_t payload_len = 0;
+    uint8_t incompat_flags = 0;
+    uint8_t seq = 0;
+    uint8_t sysid = 0;
+    uint8_t compid = 0;
+    uint32_t msgid = 0;
+
+    // Where and when the frame was received, for the forwarding latency stats
+    mono_time ingress_time = 0;
+    int ingress_link = -1;
+
+    // Returns an empty frame, from the pool if one is free
+    static frame_ptr alloc();
+
+    // Decode the header fields from data, data must hold a complete frame
+    void parseHeader();
+
+    const uint8_t *payload() const
+    {
+        return data + (magic == MAVLINK_STX ? MAVLINK_NUM_HEADER_BYTES : MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1);
+    }
+
+    // Payload accessors by wire offset. MAVLink2 trims trailing zeros from
+    // the payload, so anything past the end of it reads as zero
+    uint8_t payloadUint8(unsigned offset) const
+    {
+        return offset < payload_len ? payload()[offset] : 0;
+    }
+
+    uint16_t payloadUint16(unsigned offset) const
+    {
+        return payloadUint8(offset) | (payloadUint8(offset + 1) << 8);
+    }
+
+    std::atomic<int> refcount{0};
+};
+
+void intrusive_ptr_add_ref(mavframe *frame);
+void intrusive_ptr_release(mavframe *frame);
+
+#endif
@@ -0,0 +1,87 @@
+#include "mavhelper.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+// Compiled in with MAVLINK_USE_MESSAGE_INFO, ordered by msgid. This is the
+// only copy in the program
+static const mavlink_message_info_t message_info[] = MAVLINK_MESSAGE_INFO;
+static const size_t num_messages = sizeof(message_info) / sizeof(message_info[0]);
+
+// The targets are not in a consistent position in the packets, so every
+// message type in the dialect gets an entry in a msgid indexed table. The
+// table is generated from the message info so it never falls behind the
+// dialect.
+static std::vector<msg_targets> buildTargetTable()
+{
+    uint32_t max_msgid = 0;
+    for (size_t i = 0; i < num_messages; i++)
+    {
+        if (message_info[i].msgid > max_msgid)
+            max_msgid = message_info[i].msgid;
+    }
+
+    std::vector<msg_targets> table(max_msgid + 1);
+    for (size_t i = 0; i < num_messages; i++)
+    {
+        const mavlink_message_info_t &info = message_info[i];
+        for (unsigned f = 0; f < info.num_fields; f++)
+        {
+            const mavlink_field_info_t &field = info.fields[f];
+            // Targets are always single uint8_t fields
+            if (field.type != MAVLINK_TYPE_UINT8_T || field.array_length != 0)
+                continue;
+
+            if (strcmp(field.name, "target_system") == 0)
+                table[info.msgid].system_offset = field.wire_offset;
+            else if (strcmp(field.name, "target_component") == 0)
+                table[info.msgid].component_offset = field.wire_offset;
+        }
+    }
+    return table;
+}
+
+static const std::vector<msg_targets> target_table = buildTargetTable();
+
+void getTargets(const mavframe &frame, int16_t &sysid, int16_t &compid)
+{
+    if (frame.msgid >= target_table.size())
+        return;
+
+    // A target trimmed off the end of a MAVLink2 payload reads as zero,
+    // which is broadcast
+    const msg_targets &targets = target_table[frame.msgid];
+    if (targets.system_offset != MAV_NO_TARGET)
+        sysid = frame.payloadUint8(targets.system_offset);
+    if (targets.component_offset != MAV_NO_TARGET)
+        compid = frame.payloadUint8(targets.component_offset);
+}
+
+const mavlink_message_info_t *messageInfoById(uint32_t msgid)
+{
+    const mavlink_message_info_t *end = message_info + num_messages;
+    const mavlink_message_info_t *found = std::lower_bound(message_info, end, msgid,
+                                                           [](const mavlink_message_info_t &info, uint32_t id)
+    {
+        return info.msgid < id;
+    });
+    return found != end && found->msgid == msgid ? found : nullptr;
+}
+
+const mavlink_message_info_t *messageInfoByName(const char *name)
+{
+    // Only used while reading the config and at the shell
+    for (size_t i = 0; i < num_messages; i++)
+    {
+        if (strcmp(message_info[i].name, name) == 0)
+            return &message_info[i];
+    }
+    return nullptr;
+}
+
+const mavlink_message_info_t *dialectMessages(size_t &count)
+{
+    count = num_messages;
+    return message_info;
+}
@@ -0,0 +1,202 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * PARSER CLASS
+ * Frames MAVLink packets out of a byte stream without decoding them. Only
+ * the header is looked at and the checksum is checked once, the frame keeps
+ * the exact bytes that were received (including any MAVLink2 signature) so
+ * it can be forwarded as is. Each link owns its own parser.
+ * Works on whole receive buffers: frame starts are found by scanning for the
+ * start bytes and the rest of a frame is copied in bulk, the checksum is
+ * then computed with a lookup table. When a frame is rejected the bytes after
+ * its start byte are scanned again, so a stray start byte in line noise
+ * doesn't swallow the good frames that follow it.
+ */
+
+#include "mavparser.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+// Slicing by 4: entries[k][i] is the CRC of byte i followed by k zero
+// bytes, so four bytes fold in with four independent lookups
+struct crc_table_t
+{
+    uint16_t entries[4][256];
+
+    crc_table_t()
+    {
+        // Reflected form of the X.25 polynomial
+        for (int i = 0; i < 256; i++)
+        {
+            uint16_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+            entries[0][i] = crc;
+        }
+        for (int k = 1; k < 4; k++)
+        {
+            for (int i = 0; i < 256; i++)
+                entries[k][i] = (entries[k - 1][i] >> 8) ^ entries[0][entries[k - 1][i] & 0xFF];
+        }
+    }
+};
+
+const crc_table_t crc_table;
+
+// Bytes needed before the frame length is known, the start byte, the
+// payload length and for MAVLink2 the incompat flags (signed or not)
+size_t headerPrefix(const mavframe &frame)
+{
+    return frame.data[0] == MAVLINK_STX ? 3 : 2;
+}
+
+size_t frameLength(const mavframe &frame)
+{
+    if (frame.data[0] == MAVLINK_STX_MAVLINK1)
+        return MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1 + frame.data[1] + MAVLINK_NUM_CHECKSUM_BYTES;
+
+    size_t len = MAVLINK_NUM_HEADER_BYTES + frame.data[1] + MAVLINK_NUM_CHECKSUM_BYTES;
+    if (frame.data[2] & MAVLINK_IFLAG_SIGNED)
+        len += MAVLINK_SIGNATURE_BLOCK_LEN;
+    return len;
+}
+}
+
+uint16_t crc_calculate_table(const uint8_t *buf, size_t len, uint16_t crc)
+{
+    const uint16_t (*t)[256] = crc_table.entries;
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        uint16_t x = crc ^ (buf[i] | (buf[i + 1] << 8));
+        crc = t[3][x & 0xFF] ^ t[2][x >> 8] ^ t[1][buf[i + 2]] ^ t[0][buf[i + 3]];
+    }
+    for (; i < len; i++)
+        crc = (crc >> 8) ^ t[0][(crc ^ buf[i]) & 0xFF];
+    return crc;
+}
+
+size_t mavparser::parse(const uint8_t *buf, size_t len, frame_ptr &frame)
+{
+    // Requeued bytes can hold several frames, so a frame may come back
+    // after all of buf has been used and even when len is 0
+    size_t pos = 0;
+    for (;;)
+    {
+        // The tail of a rejected frame is looked at again before any new bytes
+        bool from_rescan = rescan_pos < rescan_len;
+        const uint8_t *src = from_rescan ? rescan + rescan_pos : buf + pos;
+        size_t available = from_rescan ? rescan_len - rescan_pos : len - pos;
+        if (available == 0)
+            break;
+
+        bool rejected = false;
+        size_t used = consume(src, available, frame, rejected);
+        if (from_rescan)
+            rescan_pos += used;
+        else
+            pos += used;
+
+        if (frame)
+            break;
+        if (rejected)
+            requeueRejected();
+    }
+    return pos;
+}
+
+size_t mavparser::consume(const uint8_t *buf, size_t len, frame_ptr &frame, bool &rejected)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        if (!current)
+            current = mavframe::alloc();
+
+        mavframe &rx = *current;
+
+        // Waiting for the start of a frame, skip straight to the next start byte
+        if (rx.len == 0)
+        {
+            while (pos < len && buf[pos] != MAVLINK_STX && buf[pos] != MAVLINK_STX_MAVLINK1)
+                pos++;
+            if (pos == len)
+                break;
+            rx.data[rx.len++] = buf[pos++];
+        }
+
+        // First get enough of the header to know the frame length,
+        // then the rest of the frame in one go
+        size_t wanted = headerPrefix(rx);
+        if (rx.len >= wanted)
+            wanted = frameLength(rx);
+
+        size_t n = std::min(wanted - rx.len, len - pos);
+        memcpy(rx.data + rx.len, buf + pos, n);
+        rx.len += n;
+        pos += n;
+
+        if (rx.len < wanted || rx.len == headerPrefix(rx))
+            continue;
+
+        if (checkFrame())
+        {
+            frame.swap(current);
+            current.reset();
+            break;
+        }
+
+        bad_frames++;
+        rejected = true;
+        break;
+    }
+    return pos;
+}
+
+void mavparser::requeueRejected()
+{
+    mavframe &rx = *current;
+
+    // The start byte may have been noise in front of real frames, so
+    // everything after it is scanned again, ahead of what was still
+    // waiting to be rescanned. Together they never hold more than one
+    // frame's worth: only bytes which were already held get requeued
+    uint8_t rest[MAVLINK_MAX_PACKET_LEN];
+    size_t tail = rx.len - 1;
+    size_t waiting = rescan_len - rescan_pos;
+    memcpy(rest, rx.data + 1, tail);
+    memcpy(rest + tail, rescan + rescan_pos, waiting);
+    memcpy(rescan, rest, tail + waiting);
+    rescan_len = tail + waiting;
+    rescan_pos = 0;
+    rx.len = 0;
+}
+
+bool mavparser::checkFrame()
+{
+    mavframe &frame = *current;
+
+    // Reject MAVLink2 features we don't know about
+    if (frame.data[0] == MAVLINK_STX && (frame.data[2] & ~MAVLINK_IFLAG_SIGNED))
+        return false;
+
+    frame.parseHeader();
+
+    // The checksum is seeded per message type so we can't validate
+    // messages which aren't in the dialect
+    const mavlink_msg_entry_t *entry = mavlink_get_msg_entry(frame.msgid);
+    if (entry == nullptr)
+        return false;
+
+    const uint8_t *payload = frame.payload();
+    const uint8_t *ck = payload + frame.payload_len;
+
+    // Checksum covers everything after the start byte up to the checksum
+    uint16_t crc = crc_calculate_table(frame.data + 1, ck - (frame.data + 1));
+    crc = crc_calculate_table(&entry->crc_extra, 1, crc);
+
+    return ck[0] == (crc & 0xFF) && ck[1] == (crc >> 8);
+}
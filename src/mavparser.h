@@ -0,0 +1,52 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * PARSER CLASS
+ * Frames MAVLink packets out of a byte stream without decoding them. Only
+ * the header is looked at and the checksum is checked once, the frame keeps
+ * the exact bytes that were received (including any MAVLink2 signature) so
+ * it can be forwarded as is. Each link owns its own parser.
+ * Works on whole receive buffers: frame starts are found by scanning for the
+ * start bytes and the rest of a frame is copied in bulk, the checksum is
+ * then computed with a lookup table. When a frame is rejected the bytes after
+ * its start byte are scanned again, so a stray start byte in line noise
+ * doesn't swallow the good frames that follow it.
+ */
+#ifndef MAVPARSER_H
+#define MAVPARSER_H
+
+#include <stddef.h>
+#include "mavframe.h"
+
+class mavparser
+{
+public:
+    // Consumes bytes from buf until a complete frame with a good checksum
+    // has been received or buf runs out, returns the number of bytes used.
+    // frame is set to the completed frame, if there was one. Keep calling
+    // until no frame is returned, even once all of buf has been used, as
+    // held back bytes can hold more frames
+    size_t parse(const uint8_t *buf, size_t len, frame_ptr &frame);
+
+    // Frames thrown away because of a bad checksum or unknown message
+    long bad_frames = 0;
+
+private:
+    frame_ptr current;
+
+    // Bytes of rejected frames still to be scanned again
+    uint8_t rescan[MAVLINK_MAX_PACKET_LEN];
+    size_t rescan_len = 0;
+    size_t rescan_pos = 0;
+
+    // parse() for one source of bytes, stops at a good frame or a rejected one
+    size_t consume(const uint8_t *buf, size_t len, frame_ptr &frame, bool &rejected);
+    // Moves all but the start byte of the rejected frame in front of rescan
+    void requeueRejected();
+    bool checkFrame();
+};
+
+// CRC-16/MCRF4XX as used by MAVLink (same result as crc_calculate)
+uint16_t crc_calculate_table(const uint8_t *buf, size_t len, uint16_t crc = 0xFFFF);
+
+#endif
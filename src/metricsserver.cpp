@@ -0,0 +1,360 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * METRICS SERVER CLASS
+ * Serves the link counters, per system stats, radio stats and forwarding
+ * latency histograms over HTTP in the Prometheus text format, for headless
+ * setups where nobody is at the shell. It listens on localhost only and runs
+ * on its own thread, and everything it reports is read from atomics or
+ * published snapshots, so a scrape never holds up forwarding.
+ */
+
+#include "metricsserver.h"
+
+#include <iostream>
+#include <limits>
+
+namespace
+{
+// Label values are quoted, so quotes, backslashes and newlines are escaped
+std::string escapeLabel(const std::string &value)
+{
+    std::string escaped;
+    for (auto c = value.begin(); c != value.end(); ++c)
+    {
+        if (*c == '\\' || *c == '"')
+            escaped += '\\';
+        if (*c == '\n')
+            escaped += "\\n";
+        else
+            escaped += *c;
+    }
+    return escaped;
+}
+
+void writeHeader(std::ostringstream &out, const char *name, const char *type, const char *help)
+{
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+}
+
+// One sample per link, value picks what is reported
+template <typename Getter>
+void writeLinkFamily(std::ostringstream &out, std::vector<std::shared_ptr<mlink> > *links,
+                     const char *name, const char *type, const char *help, Getter value)
+{
+    writeHeader(out, name, type, help);
+    for (auto link = links->begin(); link != links->end(); ++link)
+    {
+        out << name << "{link=\"" << escapeLabel((*link)->info.link_name) << "\"} "
+            << value(**link) << "\n";
+    }
+}
+}
+
+metricsserver::metricsserver(int port, std::vector<std::shared_ptr<mlink> > *links_)
+{
+    links = links_;
+
+    // Nothing outside this machine needs to scrape directly
+    boost::asio::ip::tcp::endpoint listen(boost::asio::ip::address_v4::loopback(), port);
+    acceptor.open(listen.protocol());
+    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    acceptor.bind(listen);
+    acceptor.listen();
+
+    accept();
+
+    thread = boost::thread([this] { io_service.run(); });
+}
+
+metricsserver::~metricsserver()
+{
+    io_service.stop();
+    thread.join();
+}
+
+void metricsserver::accept()
+{
+    request_ptr request = std::make_shared<http_request>(io_service);
+    acceptor.async_accept(request->socket,
+                          boost::bind(&metricsserver::handleAccept, this, request,
+                                      boost::asio::placeholders::error));
+}
+
+void metricsserver::handleAccept(request_ptr request, const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted)
+        return;
+
+    if (error)
+    {
+        // Accepting again straight away would fail the same way in a busy loop
+        std::cout << "Metrics: failed to accept a client: " << error.message() << std::endl;
+        accept_timer.expires_from_now(boost::posix_time::milliseconds(METRICS_ACCEPT_RETRY_MS));
+        accept_timer.async_wait(boost::bind(&metricsserver::handleAcceptTimer, this,
+                                            boost::asio::placeholders::error));
+        return;
+    }
+
+    request->timeout.expires_from_now(boost::posix_time::milliseconds(METRICS_REQUEST_TIMEOUT_MS));
+    request->timeout.async_wait(boost::bind(&metricsserver::handleTimeout, this, request,
+                                            boost::asio::placeholders::error));
+
+    // The request itself doesn't matter, only that it has been sent. Fails
+    // once the request fills the streambuf without a blank line
+    boost::asio::async_read_until(request->socket, request->request, "\r\n\r\n",
+                                  boost::bind(&metricsserver::handleRead, this, request,
+                                              boost::asio::placeholders::error));
+
+    //And wait for the next scrape
+    accept();
+}
+
+void metricsserver::handleAcceptTimer(const boost::system::error_code& error)
+{
+    if (!error)
+        accept();
+}
+
+void metricsserver::handleRead(request_ptr request, const boost::system::error_code& error)
+{
+    if (error)
+    {
+        close(request);
+        return;
+    }
+
+    std::istream request_stream(&request->request);
+    std::string method, path;
+    request_stream >> method >> path;
+
+    std::string status = "200 OK";
+    std::string body;
+    if (method != "GET")
+    {
+        status = "405 Method Not Allowed";
+    }
+    else if (path != "/metrics" && path != "/")
+    {
+        status = "404 Not Found";
+    }
+    else
+    {
+        body = render();
+    }
+
+    std::ostringstream response;
+    response << "HTTP/1.1 " << status << "\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << body.size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << body;
+    request->response = response.str();
+
+    boost::asio::async_write(request->socket, boost::asio::buffer(request->response),
+                             boost::bind(&metricsserver::handleWrite, this, request,
+                                         boost::asio::placeholders::error));
+}
+
+void metricsserver::handleWrite(request_ptr request, const boost::system::error_code&)
+{
+    // Written or not, the response is all there is to send
+    close(request);
+}
+
+void metricsserver::handleTimeout(request_ptr request, const boost::system::error_code& error)
+{
+    // Aborted when the request finished in time
+    if (error == boost::asio::error::operation_aborted)
+        return;
+
+    // Closing fails the pending read or write, which lets go of the request
+    boost::system::error_code ignored;
+    request->socket.close(ignored);
+}
+
+void metricsserver::close(request_ptr request)
+{
+    boost::system::error_code ignored;
+    request->timeout.cancel(ignored);
+    request->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+    request->socket.close(ignored);
+}
+
+std::string metricsserver::render()
+{
+    std::ostringstream out;
+    // Enough digits that bucket bounds print exactly
+    out.precision(12);
+    renderLinks(out);
+    renderSystems(out);
+    renderRadios(out);
+    renderLatency(out);
+    return out.str();
+}
+
+void metricsserver::renderLinks(std::ostringstream &out)
+{
+    writeLinkFamily(out, links, "cmavnode_packets_received_total", "counter",
+                    "Packets received on the link",
+                    [](const mlink &link) { return link.totalPacketCount.get(); });
+    writeLinkFamily(out, links, "cmavnode_packets_queued_total", "counter",
+                    "Packets queued to be sent on the link, including ones the link drops later",
+                    [](const mlink &link) { return link.totalPacketQueued.get(); });
+    writeLinkFamily(out, links, "cmavnode_bytes_received_total", "counter",
+                    "Bytes of packets received on the link",
+                    [](const mlink &link) { return link.totalBytesReceived.get(); });
+    writeLinkFamily(out, links, "cmavnode_bytes_queued_total", "counter",
+                    "Bytes of packets queued to be sent on the link, including ones the link drops later",
+                    [](const mlink &link) { return link.totalBytesQueued.get(); });
+
+    const char *dropped = "cmavnode_packets_dropped_total";
+    writeHeader(out, dropped, "counter", "Packets dropped on the link, by reason");
+    for (auto link = links->begin(); link != links->end(); ++link)
+    {
+        const mlink::drop_counters &drops = (*link)->drops;
+        std::string name = escapeLabel((*link)->info.link_name);
+        out << dropped << "{link=\"" << name << "\",reason=\"repeat\"} " << drops.repeat.get() << "\n"
+            << dropped << "{link=\"" << name << "\",reason=\"simulated\"} " << drops.simulated.get() << "\n"
+            << dropped << "{link=\"" << name << "\",reason=\"incoming_queue_full\"} " << drops.incoming_full.get() << "\n"
+            << dropped << "{link=\"" << name << "\",reason=\"outgoing_queue_full\"} " << drops.outgoing_full.get() << "\n"
+            << dropped << "{link=\"" << name << "\",reason=\"write_backlog\"} " << (*link)->backlog_drops.load() << "\n"
+            << dropped << "{link=\"" << name << "\",reason=\"slow_peer\"} " << drops.slow_peer.get() << "\n"
+            << dropped << "{link=\"" << name << "\",reason=\"rate_limited\"} " << drops.rate_limited.get() << "\n"
+            << dropped << "{link=\"" << name << "\",reason=\"superseded\"} " << drops.superseded.get() << "\n";
+    }
+
+    writeLinkFamily(out, links, "cmavnode_incoming_queue_depth", "gauge",
+                    "Packets waiting to be routed",
+                    [](mlink &link) { return link.in_counter.get(); });
+    writeLinkFamily(out, links, "cmavnode_outgoing_queue_depth", "gauge",
+                    "Packets waiting to be sent",
+                    [](mlink &link) { return link.out_counter.get(); });
+    writeLinkFamily(out, links, "cmavnode_write_backlog_bytes", "gauge",
+                    "Bytes handed to the port but not written yet",
+                    [](const mlink &link) { return link.write_backlog.load(); });
+}
+
+void metricsserver::renderSystems(std::ostringstream &out)
+{
+    // Snapshots are taken once so every family sees the same systems
+    std::vector<mlink::stats_snapshot> snapshots;
+    for (auto link = links->begin(); link != links->end(); ++link)
+        snapshots.push_back((*link)->statsSnapshot());
+
+    struct family
+    {
+        const char *name;
+        const char *type;
+        const char *help;
+    };
+    const family families[] =
+    {
+        {"cmavnode_system_packets_received_total", "counter", "Packets received from the system on the link"},
+        {"cmavnode_system_packets_lost_total", "counter", "Gaps in the system's sequence numbers on the link"},
+        {"cmavnode_system_packets_dropped_total", "counter", "Repeats of the system's packets dropped on the link"},
+        {"cmavnode_system_packet_loss_percent", "gauge", "Recent packet loss from the system on the link"}
+    };
+
+    for (int i = 0; i < 4; i++)
+    {
+        writeHeader(out, families[i].name, families[i].type, families[i].help);
+        for (size_t l = 0; l < links->size(); l++)
+        {
+            std::string name = escapeLabel(links->at(l)->info.link_name);
+            for (auto system = snapshots[l]->begin(); system != snapshots[l]->end(); ++system)
+            {
+                out << families[i].name << "{link=\"" << name << "\",sysid=\"" << (int)system->sysid << "\"} ";
+                switch (i)
+                {
+                case 0:
+                    out << system->num_packets_received;
+                    break;
+                case 1:
+                    out << system->packets_lost;
+                    break;
+                case 2:
+                    out << system->packets_dropped;
+                    break;
+                default:
+                    out << system->packet_loss_percent;
+                    break;
+                }
+                out << "\n";
+            }
+        }
+    }
+}
+
+void metricsserver::renderRadios(std::ostringstream &out)
+{
+    // Only SiK radio links report any of these
+    std::vector<std::shared_ptr<mlink> > radios;
+    for (auto link = links->begin(); link != links->end(); ++link)
+    {
+        if ((*link)->info.SiK_radio)
+            radios.push_back(*link);
+    }
+    if (radios.empty())
+        return;
+
+    writeHeader(out, "cmavnode_radio_rssi", "gauge", "SiK radio RSSI");
+    for (auto link = radios.begin(); link != radios.end(); ++link)
+    {
+        std::string name = escapeLabel((*link)->info.link_name);
+        out << "cmavnode_radio_rssi{link=\"" << name << "\",side=\"local\"} " << (*link)->link_quality.local_rssi.load() << "\n"
+            << "cmavnode_radio_rssi{link=\"" << name << "\",side=\"remote\"} " << (*link)->link_quality.remote_rssi.load() << "\n";
+    }
+    writeHeader(out, "cmavnode_radio_noise", "gauge", "SiK radio noise level");
+    for (auto link = radios.begin(); link != radios.end(); ++link)
+    {
+        std::string name = escapeLabel((*link)->info.link_name);
+        out << "cmavnode_radio_noise{link=\"" << name << "\",side=\"local\"} " << (*link)->link_quality.local_noise.load() << "\n"
+            << "cmavnode_radio_noise{link=\"" << name << "\",side=\"remote\"} " << (*link)->link_quality.remote_noise.load() << "\n";
+    }
+    writeLinkFamily(out, &radios, "cmavnode_radio_rx_errors", "gauge",
+                    "Receive errors reported by the SiK radio",
+                    [](const mlink &link) { return link.link_quality.rx_errors.load(); });
+    writeLinkFamily(out, &radios, "cmavnode_radio_corrected_packets", "gauge",
+                    "Packets corrected by the SiK radio",
+                    [](const mlink &link) { return link.link_quality.corrected_packets.load(); });
+    writeLinkFamily(out, &radios, "cmavnode_radio_tx_buffer_percent", "gauge",
+                    "How full the SiK radio's transmit buffer is",
+                    [](const mlink &link) { return link.link_quality.tx_buffer.load(); });
+}
+
+void metricsserver::renderLatency(std::ostringstream &out)
+{
+    const char *name = "cmavnode_forward_latency_seconds";
+    writeHeader(out, name, "histogram", "Time from a packet being received to being sent on another link");
+    for (auto out_link = links->begin(); out_link != links->end(); ++out_link)
+    {
+        for (size_t in_id = 0; in_id < (*out_link)->numLatencySources(); in_id++)
+        {
+            const latencyhistogram *found = (*out_link)->latencyFrom(in_id);
+            if (!found || found->count() == 0)
+                continue;
+            const latencyhistogram &histogram = *found;
+
+            std::ostringstream labels;
+            labels << "from=\"" << escapeLabel(links->at(in_id)->info.link_name)
+                   << "\",to=\"" << escapeLabel((*out_link)->info.link_name) << "\"";
+
+            // le is inclusive. Latencies are whole microseconds and the
+            // histogram's buckets end just under each power of two, so the
+            // bounds are one microsecond less than that
+            for (int bits = LATENCY_SUB_BITS; bits <= LATENCY_MAX_BITS; bits++)
+            {
+                mono_time bound = ((mono_time)1 << bits) - 1;
+                out << name << "_bucket{" << labels.str() << ",le=\""
+                    << (double)bound / MONO_US_PER_SEC << "\"} " << histogram.countAtMost(bound) << "\n";
+            }
+            // Counted after the buckets so it is never less than any of them
+            uint64_t count = histogram.countAtMost(std::numeric_limits<mono_time>::max());
+            out << name << "_bucket{" << labels.str() << ",le=\"+Inf\"} " << count << "\n"
+                << name << "_sum{" << labels.str() << "} " << (double)histogram.sum() / MONO_US_PER_SEC << "\n"
+                << name << "_count{" << labels.str() << "} " << count << "\n";
+        }
+    }
+}
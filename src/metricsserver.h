@@ -0,0 +1,78 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * METRICS SERVER CLASS
+ * Serves the link counters, per system stats, radio stats and forwarding
+ * latency histograms over HTTP in the Prometheus text format, for headless
+ * setups where nobody is at the shell. It listens on localhost only and runs
+ * on its own thread, and everything it reports is read from atomics or
+ * published snapshots, so a scrape never holds up forwarding.
+ */
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "mlink.h"
+
+// A scrape request is a few hundred bytes, a client sending more than this
+// before the blank line is dropped
+#define METRICS_MAX_REQUEST_BYTES 8192
+// How long a client has to send its request and read the response before
+// the connection is closed, so a stalled client doesn't hold a socket open
+#define METRICS_REQUEST_TIMEOUT_MS 5000
+// How long to wait before accepting again after accept fails
+#define METRICS_ACCEPT_RETRY_MS 1000
+
+class metricsserver
+{
+public:
+    // links must already be numbered and have their latency histograms
+    metricsserver(int port, std::vector<std::shared_ptr<mlink> > *links_);
+    ~metricsserver();
+
+private:
+    std::vector<std::shared_ptr<mlink> > *links;
+
+    boost::asio::io_service io_service;
+    boost::asio::ip::tcp::acceptor acceptor {io_service};
+    boost::asio::deadline_timer accept_timer {io_service};
+    boost::thread thread;
+
+    // One scrape, kept alive by the handlers until the response is written
+    // or the timeout closes it
+    struct http_request
+    {
+        http_request(boost::asio::io_service &io_service) :
+            socket(io_service), timeout(io_service), request(METRICS_MAX_REQUEST_BYTES) {}
+
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::deadline_timer timeout;
+        boost::asio::streambuf request;
+        std::string response;
+    };
+    typedef std::shared_ptr<http_request> request_ptr;
+
+    void accept();
+    void handleAccept(request_ptr request, const boost::system::error_code& error);
+    void handleAcceptTimer(const boost::system::error_code& error);
+    void handleRead(request_ptr request, const boost::system::error_code& error);
+    void handleWrite(request_ptr request, const boost::system::error_code& error);
+    void handleTimeout(request_ptr request, const boost::system::error_code& error);
+    void close(request_ptr request);
+
+    // The whole exposition, built fresh for every scrape
+    std::string render();
+    void renderLinks(std::ostringstream &out);
+    void renderSystems(std::ostringstream &out);
+    void renderRadios(std::ostringstream &out);
+    void renderLatency(std::ostringstream &out);
+};
+
+#endif
@@ -9,43 +9,181 @@
 
 #include "mlink.h"
 
-std::unordered_map<uint8_t, std::map<uint16_t, boost::posix_time::ptime> > mlink::recently_received;
-std::vector<boost::posix_time::time_duration> mlink::static_link_delay;
-std::mutex mlink::recently_received_mutex;
-std::set<uint8_t> mlink::sysIDs_all_links;
-
-mlink::mlink(link_info info_)
+dedupfilter mlink::recently_received;
+notifier mlink::incoming_notifier;
+boost::asio::io_service *mlink::shared_io_service = nullptr;
+
+mlink::mlink(link_info info_) :
+    qMavOut(MAV_OUTGOING_LENGTH, info_.priority_classes, info_.priority_weights, info_.latest_only),
+    own_io_service(shared_io_service ? nullptr : new boost::asio::io_service()),
+    io_service_(shared_io_service ? *shared_io_service : *own_io_service),
+    strand_(io_service_)
 {
     info = info_;
     // No clients at this moment
     sleep = true;
-    static_link_delay.push_back(boost::posix_time::time_duration(0,0,0,0));
+    published_stats = std::make_shared<std::vector<sysid_summary> >();
 
     //if we are simulating init the random generator
     if( info.sim_enable) srand(time(NULL));
 }
 
-void mlink::qAddOutgoing(mavlink_message_t msg)
+void mlink::qAddOutgoing(const frame_ptr &frame)
 {
     if(!is_kill)
     {
-        if(qMavOut.push(msg))
+        traffic_class tclass = qMavOut.classOf(frame->msgid);
+
+        // The link is writing slower than packets are arriving, drop here
+        // rather than let the delay build up. Control and heartbeats are few
+        // and jump the queue, so they are never what's holding it up, and a
+        // latest only stream never has more than one sample waiting
+        if(info.max_backlog > 0 && tclass >= traffic_class::TELEMETRY &&
+                write_backlog.load(std::memory_order_relaxed) + out_bytes.get() >= info.max_backlog &&
+                !qMavOut.isLatestOnly(frame->msgid))
         {
-            out_counter.increment();
-            totalPacketSent++;
+            backlog_drops++;
+            return;
         }
-        else
+
+        frame_ptr replaced;
+        if(!qMavOut.push(frame, tclass, replaced))
         {
+            drops.outgoing_full.increment();
             std::cout << "MLINK: The outgoing queue is full" << std::endl;
         }
+        else if(replaced)
+        {
+            // Took the place of an older sample, nothing new to wake the writer for
+            drops.superseded.increment();
+            if(info.max_backlog > 0)
+                out_bytes.add(frame->len - replaced->len);
+            totalBytesQueued.add(frame->len - replaced->len);
+        }
+        else
+        {
+            out_counter.increment();
+            if(info.max_backlog > 0)
+                out_bytes.add(frame->len);
+            totalPacketQueued.increment();
+            totalBytesQueued.add(frame->len);
+            // Wake the writer unless a drain is already on its way, or the
+            // held queue just grew long enough to be let go
+            if(!drain_pending.exchange(true) ||
+                    (held_drain_frames > 0 && out_counter.get() == held_drain_frames))
+                notifyOutgoing();
+        }
     }
 }
 
-bool mlink::qReadIncoming(mavlink_message_t *msg)
+void mlink::startIO()
 {
-    //Will return true if a message was returned by refference
+    startHousekeeping();
+
+    if (own_io_service)
+        read_thread = boost::thread(&mlink::runReadThread, this);
+}
+
+void mlink::stopIO()
+{
+    //Force run() to return then join thread
+    if (own_io_service)
+    {
+        io_service_.stop();
+        read_thread.join();
+    }
+}
+
+void mlink::runReadThread()
+{
+    //gets run in thread
+    //Because io_service.run() will block while the link is open
+    io_service_.run();
+}
+
+mlink::~mlink()
+{
+    for (size_t i = 0; i < latency_sources; i++)
+        delete ingress_latency[i].load();
+}
+
+void mlink::setupLatency(size_t num_links)
+{
+    ingress_latency.reset(new std::atomic<latencyhistogram *>[num_links]);
+    for (size_t i = 0; i < num_links; i++)
+        ingress_latency[i] = nullptr;
+    latency_sources = num_links;
+}
+
+void mlink::recordLatency(int link_id, mono_time latency)
+{
+    if (link_id < 0 || (size_t)link_id >= latency_sources)
+        return;
+
+    // Only the strand stores, readers see either null or a whole histogram
+    latencyhistogram *histogram = ingress_latency[link_id].load(std::memory_order_relaxed);
+    if (!histogram)
+    {
+        histogram = new latencyhistogram();
+        ingress_latency[link_id].store(histogram, std::memory_order_release);
+    }
+    histogram->record(latency);
+}
+
+void mlink::startHousekeeping()
+{
+    housekeeping_timer.expires_from_now(boost::posix_time::milliseconds(MAV_HOUSEKEEPING_INTERVAL_MS));
+    housekeeping_timer.async_wait(strand_.wrap(boost::bind(&mlink::handleHousekeepingTimer, this,
+                                                           boost::asio::placeholders::error)));
+}
+
+void mlink::handleHousekeepingTimer(const boost::system::error_code& error)
+{
+    if (error)
+        return;
+
+    checkForDeadSysID();
+    publishStats();
+    msg_stats.updateRates(monoclock::now());
+    startHousekeeping();
+}
+
+void mlink::notifyOutgoing()
+{
+    strand_.post(boost::bind(&mlink::drainOutgoing, this));
+}
+
+void mlink::drainOutgoing()
+{
+    // Clear first so anything queued while draining schedules another drain
+    drain_pending = false;
+
+    // One clock read for everything sent in this drain
+    mono_time now = monoclock::now();
+
+    frame_ptr frame;
+    bool ready;
+    while((ready = readyToSend()) && qMavOut.pop(frame))
+    {
+        out_counter.decrement();
+        if (info.max_backlog > 0)
+            out_bytes.add(-frame->len);
+        recordLatency(frame->ingress_link, now - frame->ingress_time);
+        processAndSend(frame);
+    }
+
+    // The link will drain again once its write completes, frames queued
+    // until then don't need to schedule a drain of their own
+    if (!ready)
+        drain_pending = true;
+    flushOutgoing();
+}
+
+bool mlink::qReadIncoming(frame_ptr *frame)
+{
+    //Will return true if a frame was returned by refference
     //false if the incoming queue is empty
-    if(qMavIn.pop(*msg))
+    if(qMavIn.pop(*frame))
     {
         in_counter.decrement();
         return true;
@@ -53,21 +191,30 @@ bool mlink::qReadIncoming(mavlink_message_t *msg)
     else return false;
 }
 
-bool mlink::seenSysID(const uint8_t sysid) const
+bool mlink::qReadRouteUpdate(route_update *update)
 {
-    // returns true if this system ID has been seen on this link
-    for (auto iter = sysID_stats.begin(); iter != sysID_stats.end(); ++iter)
+    return qRouteUpdate.pop(*update);
+}
+
+void mlink::parseIncoming(const uint8_t *buf, size_t len, mavparser &parser)
+{
+    // Frames keep the bytes they were received as, nothing on the receive
+    // path needs the message decoded and they are forwarded untouched
+    frame_ptr frame;
+    // The parser only stops short of the end of buf with a frame, and may
+    // still have frames held back once buf is used up
+    size_t pos = 0;
+    for (;;)
     {
-        uint8_t this_id = iter->first;
-        if (this_id == sysid)
-        {
-            return true;
-        }
+        pos += parser.parse(buf + pos, len - pos, frame);
+        if (!frame)
+            break;
+        onMessageRecv(frame);
+        frame.reset();
     }
-    return false;
 }
 
-void mlink::onMessageRecv(mavlink_message_t *msg)
+void mlink::onMessageRecv(const frame_ptr &frame)
 {
     //Simulate Packet Loss
     if (shouldDropPacket())
@@ -75,45 +222,50 @@ void mlink::onMessageRecv(mavlink_message_t *msg)
         return;
     }
 
-    updateRouting(*msg);
+    updateRouting(*frame);
 
-    record_packet_stats(msg);
+    record_packet_stats(*frame);
+    msg_stats.recordIn(*frame);
 
     // SiK radio info
-    if (info.SiK_radio && (msg->msgid == 109 || msg->msgid == 166))
+    if (info.SiK_radio && (frame->msgid == 109 || frame->msgid == 166))
     {
         //This packet contains info about the radio link. Use the info then discard
-        handleSiKRadioPacket(msg);
+        handleSiKRadioPacket(*frame);
         return;
     }
 
-    if (record_incoming_packet(msg) == false)
+    // Links without repeat rejection skip the filter entirely
+    if (info.reject_repeat_packets && record_incoming_packet(*frame) == false)
     {
         return;
     }
 
     //We have made it this far, no reason to drop packet so add to queue
-    if(qMavIn.push(*msg))
+    frame->ingress_time = rx_time;
+    if(qMavIn.push(frame))
     {
         in_counter.increment();
+        incoming_notifier.notify();
     }
     else
     {
+        drops.incoming_full.increment();
         std::cout << "The incoming message queue is full" << std::endl;
     }
 
     return;
 }
 
-void mlink::handleSiKRadioPacket(mavlink_message_t *msg)
+void mlink::handleSiKRadioPacket(const mavframe &frame)
 {
-    link_quality.local_rssi = _MAV_RETURN_uint8_t(msg,  4);
-    link_quality.remote_rssi = _MAV_RETURN_uint8_t(msg,  5);
-    link_quality.tx_buffer = _MAV_RETURN_uint8_t(msg,  6);
-    link_quality.local_noise = _MAV_RETURN_uint8_t(msg,  7);
-    link_quality.remote_noise = _MAV_RETURN_uint8_t(msg,  8);
-    link_quality.rx_errors = _MAV_RETURN_uint16_t(msg,  0);
-    link_quality.corrected_packets = _MAV_RETURN_uint16_t(msg,  2);
+    link_quality.local_rssi = frame.payloadUint8(4);
+    link_quality.remote_rssi = frame.payloadUint8(5);
+    link_quality.tx_buffer = frame.payloadUint8(6);
+    link_quality.local_noise = frame.payloadUint8(7);
+    link_quality.remote_noise = frame.payloadUint8(8);
+    link_quality.rx_errors = frame.payloadUint16(0);
+    link_quality.corrected_packets = frame.payloadUint16(2);
 }
 
 bool mlink::shouldDropPacket()
@@ -123,6 +275,7 @@ bool mlink::shouldDropPacket()
         int randnumber = rand() % 100 + 1;
         if(randnumber < info.sim_packet_loss)
         {
+            drops.simulated.increment();
             return true;
         }
     }
@@ -133,47 +286,81 @@ void mlink::printPacketStats()
 {
     std::cout << "PACKET STATS FOR LINK: " << info.link_name << std::endl;
 
-    std::map<uint8_t, packet_stats>::iterator iter;
-    for (iter = sysID_stats.begin(); iter != sysID_stats.end(); ++iter)
+    stats_snapshot stats = statsSnapshot();
+    for (auto iter = stats->begin(); iter != stats->end(); ++iter)
     {
-        std::cout << "sysID: " << (int)iter->first
-                  << " # packets: " << iter->second.num_packets_received
+        std::cout << "sysID: " << (int)iter->sysid
+                  << " # packets: " << iter->num_packets_received
                   << std::endl;
     }
 }
 
-void mlink::updateRouting(mavlink_message_t &msg)
+mlink::stats_snapshot mlink::statsSnapshot() const
+{
+    return std::atomic_load(&published_stats);
+}
+
+void mlink::publishStats()
+{
+    // Readers keep whichever copy they loaded, the new one replaces it whole
+    std::shared_ptr<std::vector<sysid_summary> > stats = std::make_shared<std::vector<sysid_summary> >();
+    stats->reserve(sysID_stats.size());
+    for (auto iter = sysID_stats.begin(); iter != sysID_stats.end(); ++iter)
+    {
+        sysid_summary summary;
+        summary.sysid = iter->first;
+        summary.num_packets_received = iter->second.num_packets_received;
+        summary.packets_lost = iter->second.packets_lost;
+        summary.packets_dropped = iter->second.packets_dropped;
+        summary.packet_loss_percent = iter->second.packet_loss_percent;
+        stats->push_back(summary);
+    }
+    std::atomic_store(&published_stats, stats_snapshot(stats));
+}
+
+void mlink::updateRouting(const mavframe &frame)
 {
-    bool newSysID;
-    auto found = sysID_stats.find(msg.sysid);
+    bool newSysID = false;
+    auto found = sysID_stats.find(frame.sysid);
     if (found == sysID_stats.end())
     {
-        std::cout << "Adding sysID: " << (int)msg.sysid << " to the mapping on link: " << info.link_name << std::endl;
-        sysID_stats[msg.sysid].num_packets_received = 0;
-        sysIDs_all_links.insert(sysIDs_all_links.end(), msg.sysid);
+        std::cout << "Adding sysID: " << (int)frame.sysid << " to the mapping on link: " << info.link_name << std::endl;
+        sysID_stats[frame.sysid].num_packets_received = 0;
         newSysID = true;
-        found = sysID_stats.find(msg.sysid);
+        found = sysID_stats.find(frame.sysid);
+        num_systems.fetch_add(1);
+        publishStats();
     }
 
     struct packet_stats &stats = found->second;
 
     stats.num_packets_received++;
 
-    boost::posix_time::ptime nowTime = boost::posix_time::microsec_clock::local_time();
+    mono_time nowTime = rx_time;
     stats.last_packet_time = nowTime;
 
+    // Learn which components of the system are behind this link
+    auto component = stats.component_last_seen.find(frame.compid);
+    if (component == stats.component_last_seen.end())
+    {
+        // Only remember it once the routing table is sure to hear about it
+        route_update update = {route_update::COMPONENT_SEEN, component_key(frame.sysid, frame.compid)};
+        if (qRouteUpdate.push(update))
+            stats.component_last_seen[frame.compid] = nowTime;
+    }
+    else
+    {
+        component->second = nowTime;
+    }
+
     // Track link delay using heartbeats
-    if (msg.msgid == 0 && newSysID == false)
+    if (frame.msgid == 0 && newSysID == false)
     {
-        boost::posix_time::time_duration delay = nowTime
-                - link_quality.last_heartbeat
-                - boost::posix_time::time_duration(0,0,1,0);
-        link_quality.link_delay = delay.seconds();
+        mono_time delay = nowTime
+                          - link_quality.last_heartbeat
+                          - MONO_US_PER_SEC;
+        link_quality.link_delay = delay / MONO_US_PER_SEC;
         link_quality.last_heartbeat = nowTime;
-
-        // Remove old packets from recently_received
-        std::lock_guard<std::mutex> lock(recently_received_mutex);
-        flush_recently_read();
     }
 }
 
@@ -183,107 +370,81 @@ void mlink::checkForDeadSysID()
     //if they have, remove from mapping
 
     //get the time now
-    boost::posix_time::ptime nowTime = boost::posix_time::microsec_clock::local_time();
+    mono_time nowTime = monoclock::now();
 
     auto next = sysID_stats.begin();
     while (next != sysID_stats.end())
     {
         auto iter = next;
         next++;
-        boost::posix_time::time_duration dur = nowTime - iter->second.last_packet_time;
-        long time_between_packets = dur.total_milliseconds();
-        if(time_between_packets > MAV_PACKET_TIMEOUT_MS && totalPacketCount > 0)
+        long time_between_packets = (nowTime - iter->second.last_packet_time) / MONO_US_PER_MS;
+        if(time_between_packets > MAV_PACKET_TIMEOUT_MS && totalPacketCount.get() > 0)
         {
+            // If the routing table's queue is full try again next time
+            route_update update = {route_update::SYSTEM_DEAD, component_key(iter->first, 0)};
+            if (!qRouteUpdate.push(update))
+                return;
+
             // Log then erase
             std::cout << "Removing sysID: " << (int)(iter->first) << " from link: " << info.link_name << " (idle " << (double)time_between_packets/1000 << " s)" << std::endl;
+            onSystemDead(iter->first);
             sysID_stats.erase(iter);
+            num_systems.fetch_sub(1);
+            continue;
+        }
+
+        // The system is alive but some of its components may have gone
+        std::map<uint8_t, mono_time> &components = iter->second.component_last_seen;
+        auto next_component = components.begin();
+        while (next_component != components.end())
+        {
+            auto component = next_component;
+            next_component++;
+            if ((nowTime - component->second) / MONO_US_PER_MS > MAV_PACKET_TIMEOUT_MS)
+            {
+                route_update update = {route_update::COMPONENT_DEAD, component_key(iter->first, component->first)};
+                if (!qRouteUpdate.push(update))
+                    return;
+
+                std::cout << "Removing component: " << (int)iter->first << ":" << (int)component->first << " from link: " << info.link_name << std::endl;
+                components.erase(component);
+            }
         }
     }
 }
 
-bool mlink::record_incoming_packet(mavlink_message_t *msg)
+bool mlink::record_incoming_packet(const mavframe &frame)
 {
     // Returns false if the packet has already been seen and won't be forwarded
 
-    // Extract the mavlink packet into a buffer
-    uint8_t snapshot_array[msg->len + 24];
-    mavlink_msg_to_send_buffer(snapshot_array, msg);
-
-    // Don't drop heartbeats and only drop when enabled
-    if (msg->msgid == 0 || info.reject_repeat_packets == false)
+    // Don't drop heartbeats
+    if (frame.msgid == 0)
         return true;
 
-    // Ensure link threads don't cause seg faults
-    std::lock_guard<std::mutex> lock(recently_received_mutex);
-
-    // Check for repeated packets by comparing checksums
-    uint16_t payload_crc;
-    if (msg->magic == 254)
-    {
-        payload_crc = crc_calculate(snapshot_array + 6, msg->len);
-    }
-    else if (msg->magic == 253)
-    {
-        payload_crc = crc_calculate(snapshot_array + 11, msg->len);
-    }
-
     // Check whether this packet has been seen before
-    if (recently_received[msg->sysid].find(payload_crc) == recently_received[msg->sysid].end())
-    {
-        // New packet - add it
-        boost::posix_time::ptime nowTime = boost::posix_time::microsec_clock::local_time();
-        recently_received[msg->sysid].insert({payload_crc, nowTime});
+    if (recently_received.insert(dedupfilter::hashFrame(frame), rx_time))
         return true;
-    }
-    else
-    {
-        // Old packet - drop it
-        if (sysID_stats.find(msg->sysid) != sysID_stats.end())
-            ++sysID_stats[msg->sysid].packets_dropped;
-        else
-            std::cout << "Failed to find sysid when dropping packet" << std::endl;
-        return false;
-    }
-}
 
-void mlink::flush_recently_read()
-{
-    for (auto sysID = sysIDs_all_links.begin(); sysID != sysIDs_all_links.end(); ++sysID)
-    {
-        auto recent_packet_map = &recently_received[*sysID];
-        for (auto packet = recent_packet_map->begin(); packet != recent_packet_map->end(); ++packet)
-        {
-            boost::posix_time::time_duration elapsed_time = boost::posix_time::microsec_clock::local_time() - packet->second;
-            if (elapsed_time > boost::posix_time::time_duration(0,0,1,0) &&
-                    elapsed_time > max_delay())
-            {
-                recent_packet_map->erase(packet);
-            }
-        }
-    }
-}
-
-boost::posix_time::time_duration mlink::max_delay()
-{
-    boost::posix_time::time_duration ret = boost::posix_time::time_duration(0,0,0,0);
-    for (auto delay = static_link_delay.begin(); delay != static_link_delay.end(); ++delay)
-    {
-        if ((*delay) > ret)
-            ret = *delay;
-    }
-    return ret;
+    // Old packet - drop it
+    drops.repeat.increment();
+    if (sysID_stats.find(frame.sysid) != sysID_stats.end())
+        ++sysID_stats[frame.sysid].packets_dropped;
+    else
+        std::cout << "Failed to find sysid when dropping packet" << std::endl;
+    return false;
 }
 
-void mlink::record_packet_stats(mavlink_message_t *msg)
+void mlink::record_packet_stats(const mavframe &frame)
 {
 
     //increment link packet counter and sysid packet counter
-    totalPacketCount++;
+    totalPacketCount.increment();
+    totalBytesReceived.add(frame.len);
 
-    auto found = sysID_stats.find(msg->sysid);
+    auto found = sysID_stats.find(frame.sysid);
     if (found == sysID_stats.end())
     {
-        std::cout << "Failed to find sysid " << (int)msg->sysid << " on link" << info.link_name << " when recording packet stats" << std::endl;
+        std::cout << "Failed to find sysid " << (int)frame.sysid << " on link" << info.link_name << " when recording packet stats" << std::endl;
         return;
     }
 
@@ -291,27 +452,27 @@ void mlink::record_packet_stats(mavlink_message_t *msg)
 
     stats.recent_packets_received++;
 
-    if (msg->msgid != 109 && msg->msgid != 166 && totalPacketCount > 1)
+    if (frame.msgid != 109 && frame.msgid != 166 && totalPacketCount.get() > 1)
     {
-        if (stats.last_packet_sequence > msg->seq)
+        if (stats.last_packet_sequence > frame.seq)
         {
             //update total packet loss
-            stats.packets_lost += msg->seq
+            stats.packets_lost += frame.seq
                                   - stats.last_packet_sequence
                                   + 255;
             //update recent packet loss
-            stats.recent_packets_lost += msg->seq
+            stats.recent_packets_lost += frame.seq
                                          - stats.last_packet_sequence
                                          + 255;
         }
-        else if (stats.last_packet_sequence < msg->seq)
+        else if (stats.last_packet_sequence < frame.seq)
         {
             //update total packet loss
-            stats.packets_lost += msg->seq
+            stats.packets_lost += frame.seq
                                   - stats.last_packet_sequence
                                   - 1;
             //update recent packet loss
-            stats.recent_packets_lost += msg->seq
+            stats.recent_packets_lost += frame.seq
                                          - stats.last_packet_sequence
                                          - 1;
         }
@@ -328,7 +489,7 @@ void mlink::record_packet_stats(mavlink_message_t *msg)
         }
     }
 
-    stats.last_packet_sequence = msg->seq;
+    stats.last_packet_sequence = frame.seq;
 
 
 }
@@ -11,7 +11,9 @@
 
 #include <vector>
 #include <atomic>
+#include <memory>
 #include <boost/asio.hpp>
+#include <boost/bind.hpp>
 #include <boost/lockfree/spsc_queue.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
@@ -29,33 +31,96 @@
 #include <set>
 
 #include "exception.h"
+#include "notifier.h"
+#include "mavframe.h"
+#include "mavparser.h"
+#include "dedupfilter.h"
+#include "monoclock.h"
+#include "latencyhistogram.h"
+#include "msgstats.h"
+#include "priorityqueue.h"
 
 #define MAV_INCOMING_LENGTH 2000
 #define MAV_OUTGOING_LENGTH 2000
-#define OUT_QUEUE_EMPTY_SLEEP 10
 #define MAV_INCOMING_BUFFER_LENGTH 2041
 #define MAV_PACKET_TIMEOUT_MS 10000
+// How often a link checks for dead systems and republishes its stats
+#define MAV_HOUSEKEEPING_INTERVAL_MS 1000
+// Counters written by different threads are padded to a cache line each
+// so the threads don't keep stealing the line from each other
+#define CACHE_LINE_SIZE 64
 
+// Frames (or bytes) in a queue, incremented by the producer and decremented by the consumer
 struct queue_counter
 {
     std::atomic<int> value{0};
+    char pad[CACHE_LINE_SIZE - sizeof(std::atomic<int>)];
 
     void increment()
     {
-        ++value;
+        value.fetch_add(1, std::memory_order_relaxed);
     }
 
     void decrement()
     {
-        --value;
+        value.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void add(int n)
+    {
+        value.fetch_add(n, std::memory_order_relaxed);
     }
 
     int get()
     {
-        return value.load();
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+// Counter with a single writing thread, readable from any thread
+struct link_counter
+{
+    std::atomic<long> value{0};
+    char pad[CACHE_LINE_SIZE - sizeof(std::atomic<long>)];
+
+    // Only one thread writes so there is no need for a locked add
+    void increment()
+    {
+        add(1);
+    }
+
+    void add(long n)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    long get() const
+    {
+        return value.load(std::memory_order_relaxed);
     }
 };
 
+// A change to the systems seen on a link, passed from the link's read
+// path to the routing table on the main thread
+struct route_update
+{
+    enum update_kind : uint8_t
+    {
+        COMPONENT_SEEN,
+        COMPONENT_DEAD,
+        SYSTEM_DEAD // only the sysid half of component is used
+    };
+
+    update_kind kind;
+    uint16_t component; // component_key
+};
+
+// A (sysid, compid) pair packed into one key, sysid in the high byte
+inline uint16_t component_key(uint8_t sysid, uint8_t compid)
+{
+    return (uint16_t)((sysid << 8) | compid);
+}
+
 enum class link_filter_type
 {
     NONE,
@@ -73,85 +138,148 @@ struct link_info
     bool reject_repeat_packets = false;
     bool SiK_radio = false;
     bool sleep_enabled = false;
+    int udp_batch = 1; // UDP only, datagrams moved per recvmmsg/sendmmsg call. 1 disables batching
+    int coalesce_us = 0; // UDP only, how long frames may wait to share a datagram. 0 disables coalescing
+    int coalesce_max_bytes = 1400; // UDP only, a coalesced datagram is sent once it reaches this size
+    int tcp_max_pending_bytes = 65536; // TCP only, bytes queued or being written for a peer before its packets are dropped
+    int max_backlog = 0; // bytes queued or waiting to be written before telemetry for the link is dropped, 0 for no limit (serial defaults to one second's worth)
+    bool low_latency = false; // Serial only, set the kernel low latency flag (FTDI latency timer)
     link_filter_type filter_type = link_filter_type::NONE;
     std::unordered_set<uint8_t> filter_messages;
+    std::unordered_map<uint32_t, float> rate_limits; // most packets per second output of each msgid, per sysid
+    std::unordered_map<uint32_t, traffic_class> priority_classes; // outgoing traffic class of msgids, overriding the defaults
+    std::vector<int> priority_weights; // weight of each traffic class, highest priority first. Empty for strict priority
+    std::unordered_set<uint32_t> latest_only; // msgids where a new sample replaces an unsent one from the same sysid and compid
 };
 
 class mlink
 {
 public:
     mlink(link_info info_);
-    virtual ~mlink() {};
+    virtual ~mlink();
 
     int link_id;
 
     bool up = true;
 
-    //Send or read mavlink messages
-    void qAddOutgoing(mavlink_message_t msg);
-    bool qReadIncoming(mavlink_message_t *msg);
+    //Send or read mavlink messages, outgoing frames are shared between links
+    void qAddOutgoing(const frame_ptr &frame);
+    bool qReadIncoming(frame_ptr *frame);
 
-    void printPacketStats();
+    // Signalled whenever any link pushes to its incoming queue,
+    // the main loop blocks on this instead of polling
+    static notifier incoming_notifier;
 
-    // indicate if a system has been seen on a link:
-    bool seenSysID(uint8_t sysid) const;
+    // Packets recently received on any link, used to drop the same packet
+    // arriving over a second link (reject_repeat_packets)
+    static dedupfilter recently_received;
 
-    //remove dead systems from private mapping
-    void checkForDeadSysID();
+    void printPacketStats();
 
+    // Returns, in order, components seen on this link for the first time and
+    // systems and components which have gone quiet. These are picked up by
+    // the routing table on the main thread
+    bool qReadRouteUpdate(route_update *update);
 
-    void updateRouting(mavlink_message_t &msg);
-    void onMessageRecv(mavlink_message_t *msg); // returns whether to throw out this message
+    virtual void onMessageRecv(const frame_ptr &frame);
 
     bool shouldDropPacket();
 
-    //Read and write thread functions. Read thread will call ioservice.run and block
-    //Write thread will be in an infinate busy wait loop
-    virtual void runWriteThread() {};
-    virtual void runReadThread() {};
+    //Read thread function. Read thread will call ioservice.run and block,
+    //outgoing packets are also sent from this thread (see notifyOutgoing)
+    void runReadThread();
+
+    // When set, links created afterwards run on this io_service (the -t
+    // thread pool) instead of their own io_service and read thread
+    static boost::asio::io_service *shared_io_service;
 
     link_info info;
 
     queue_counter out_counter;
     queue_counter in_counter;
+    // Bytes in the outgoing queue, only kept when info.max_backlog is set
+    queue_counter out_bytes;
+
+    // Bytes taken off the outgoing queue but not written out yet, kept by
+    // links which write asynchronously. qAddOutgoing drops packets while
+    // this and out_bytes add up to more than info.max_backlog
+    std::atomic<int> write_backlog{0};
+    std::atomic<long> backlog_drops{0};
 
     bool is_kill = false;
-    long totalPacketCount = 0;
-    long totalPacketSent = 0;
+    link_counter totalPacketCount; // written by the read path
+    link_counter totalPacketQueued; // written by the main loop
+    link_counter totalBytesReceived; // written by the read path
+    link_counter totalBytesQueued; // written by the main loop
+
+    // Packets dropped, by reason. backlog_drops above covers the write backlog
+    struct drop_counters
+    {
+        link_counter repeat; // reject_repeat_packets, read path
+        link_counter simulated; // sim_packet_loss, read path
+        link_counter incoming_full; // qMavIn full, read path
+        link_counter outgoing_full; // qMavOut class queue full, main loop
+        link_counter slow_peer; // TCP peer not keeping up, read path
+        link_counter rate_limited; // rate_limit, main loop
+        link_counter superseded; // latest_only sample replaced before it was sent, main loop
+    };
+    drop_counters drops;
 
     // No activity on the endpoint
     bool sleep;
 
     // Track link quality for the link
+    // Written by the read path, atomic so the shell and metrics can read them
     struct link_quality_stats
     {
-        int local_rssi = 0;
-        int remote_rssi = 0;
-        int tx_buffer = 0;
-        int local_noise = 0;
-        int remote_noise = 0;
-        int rx_errors = 0;
-        int corrected_packets = 0;
-        boost::posix_time::ptime last_heartbeat = boost::posix_time::microsec_clock::local_time();
-        long link_delay = 0;
+        std::atomic<int> local_rssi{0};
+        std::atomic<int> remote_rssi{0};
+        std::atomic<int> tx_buffer{0};
+        std::atomic<int> local_noise{0};
+        std::atomic<int> remote_noise{0};
+        std::atomic<int> rx_errors{0};
+        std::atomic<int> corrected_packets{0};
+        mono_time last_heartbeat = monoclock::now();
+        std::atomic<long> link_delay{0};
     };
     link_quality_stats link_quality;
 
-    struct packet_stats
+    // Copy of one system's stats, see statsSnapshot()
+    struct sysid_summary
     {
-        int num_packets_received = 0;
-        int recent_packets_received = 0;
-        int recent_packets_lost = 0;
-        boost::posix_time::ptime last_packet_time;
-        uint8_t last_packet_sequence = -1;
-        uint8_t out_packet_sequence = 0;
-        int packets_lost = 0;
-        int packets_dropped = 0;
-        float packet_loss_percent = 0;
+        uint8_t sysid;
+        int num_packets_received;
+        int packets_lost;
+        int packets_dropped;
+        float packet_loss_percent;
     };
+    typedef std::shared_ptr<const std::vector<sysid_summary> > stats_snapshot;
 
-    // Track heartbeat stats for each system ID.
-    std::map<uint8_t, packet_stats> sysID_stats;
+    // Stats for every system on the link, ordered by sysid. Safe from any
+    // thread, the read path publishes a new copy every housekeeping
+    // interval and whenever a system is added or removed
+    stats_snapshot statsSnapshot() const;
+
+    // Systems currently seen on the link
+    std::atomic<int> num_systems{0};
+
+    // Time from being received on link_id to being sent on this link,
+    // null until a frame has been forwarded between the pair. Safe from
+    // any thread
+    const latencyhistogram *latencyFrom(size_t link_id) const
+    {
+        return link_id < latency_sources ? ingress_latency[link_id].load(std::memory_order_acquire) : nullptr;
+    }
+    size_t numLatencySources() const
+    {
+        return latency_sources;
+    }
+    // Call once the links are numbered, before any frames are routed
+    void setupLatency(size_t num_links);
+
+    // Packets, bytes and rates by message ID in both directions. Out counts
+    // what each link's processAndSend() passes on, after its own drops
+    msgstats msg_stats;
 
     // return endpoint corresponding to sender (if any)
     virtual boost::asio::ip::udp::endpoint *sender_endpoint()
@@ -159,37 +287,120 @@ public:
         return nullptr;
     }
 protected:
-    boost::lockfree::spsc_queue<mavlink_message_t> qMavIn {MAV_INCOMING_LENGTH};
-    boost::lockfree::spsc_queue<mavlink_message_t> qMavOut {MAV_OUTGOING_LENGTH};
+    boost::lockfree::spsc_queue<frame_ptr> qMavIn {MAV_INCOMING_LENGTH};
+    priorityqueue qMavOut;
+    boost::lockfree::spsc_queue<route_update> qRouteUpdate {1024};
+
+    // The link's own io_service, null when it runs on shared_io_service
+    std::unique_ptr<boost::asio::io_service> own_io_service;
+    boost::asio::io_service &io_service_;
+    // Every handler for the link goes through the strand, so with a shared
+    // pool of threads they still run one at a time and in order
+    boost::asio::io_service::strand strand_;
 
     boost::thread read_thread;
-    boost::thread write_thread;
+
+    // Runs checkForDeadSysID() on the strand every MAV_HOUSEKEEPING_INTERVAL_MS
+    boost::asio::deadline_timer housekeeping_timer {io_service_};
+    void startHousekeeping();
+    void handleHousekeepingTimer(const boost::system::error_code& error);
+
+    // Called once the link's first async operations are queued. Starts the
+    // read thread if the link has its own io_service
+    void startIO();
+    // Stops the read thread if the link has its own io_service
+    void stopIO();
 
     bool exitFlag = false;
 
+    // Called by qAddOutgoing when packets are waiting and no drain is
+    // scheduled yet. Posts drainOutgoing() through the strand
+    virtual void notifyOutgoing();
+    // Sends what is in qMavOut, highest priority first, for as long as
+    // readyToSend() allows. Runs on the link's io_service thread
+    void drainOutgoing();
+    // Links which write slower than frames are queued return false once
+    // they have enough for the next write, leaving the rest in qMavOut so
+    // later high priority frames can still go first. Such a link must call
+    // drainOutgoing() again when its write completes or readyToSend()
+    // could change
+    virtual bool readyToSend()
+    {
+        return true;
+    }
+    // Sends a serialised frame
+    virtual void processAndSend(const frame_ptr &) {};
+    // Called once the queue has been emptied, links which batch writes send them here
+    virtual void flushOutgoing() {};
+    // Set while a drain is scheduled, or while the queue is held back by
+    // readyToSend() and the link will drain again itself
+    std::atomic<bool> drain_pending{false};
+    // Links whose writes can stall indefinitely (a TCP peer which stopped
+    // reading) set this to the queue length at which readyToSend() lets a
+    // held queue go anyway, so reaching it schedules one more drain
+    int held_drain_frames = 0;
+
     uint8_t data_in_[MAV_INCOMING_BUFFER_LENGTH];
-    uint8_t data_out_[MAV_INCOMING_BUFFER_LENGTH];
 
-    // A record of recent incoming packets is kept to avoid repeated packets
-    // over various links to the same system ID.
-    // Each sysID is the key to a map of the bytes received in a packet
-    static std::unordered_map<uint8_t, std::map<uint16_t, boost::posix_time::ptime> > recently_received;
-    static std::mutex recently_received_mutex;
+    // Frames the link's incoming byte stream
+    mavparser incoming_parser;
 
-    // Accessor function for recently_read also performs resequencing
-    bool record_incoming_packet(mavlink_message_t *msg);
-    // Helper functions for record_incoming_packet()
-    boost::posix_time::time_duration max_delay();
-    void flush_recently_read();
-    void record_packet_stats(mavlink_message_t *msg);
-    void handleSiKRadioPacket(mavlink_message_t *msg);
+    // Turns received bytes into frames and passes them to onMessageRecv
+    void parseIncoming(const uint8_t *buf, size_t len)
+    {
+        parseIncoming(buf, len, incoming_parser);
+    }
+    // Links with several peers on separate streams keep a parser each
+    void parseIncoming(const uint8_t *buf, size_t len, mavparser &parser);
 
-    // All links have their delay tracked to periodically flush recently_received
-    static std::vector<boost::posix_time::time_duration> static_link_delay;
+    // Histograms for latencyFrom(), indexed by the link_id frames came in
+    // on. Most pairs of links never forward to each other, so each one is
+    // only allocated (by the strand) when its first frame is sent
+    std::unique_ptr<std::atomic<latencyhistogram *>[]> ingress_latency;
+    size_t latency_sources = 0;
+    void recordLatency(int link_id, mono_time latency);
 
-    std::map<uint8_t, uint8_t> new_custom_msg_crcs;
+    // When the bytes being parsed were received. Receive handlers set this
+    // once before parsing so packets don't each read the clock
+    mono_time rx_time = 0;
 
-    static std::set<uint8_t> sysIDs_all_links;
+    struct packet_stats
+    {
+        int num_packets_received = 0;
+        int recent_packets_received = 0;
+        int recent_packets_lost = 0;
+        mono_time last_packet_time = 0;
+        uint8_t last_packet_sequence = -1;
+        uint8_t out_packet_sequence = 0;
+        int packets_lost = 0;
+        int packets_dropped = 0;
+        float packet_loss_percent = 0;
+        // Components of this system seen on the link, by compid
+        std::map<uint8_t, mono_time> component_last_seen;
+    };
+
+    // Track heartbeat stats for each system ID. Only touched from the
+    // link's strand, other threads use statsSnapshot()
+    std::map<uint8_t, packet_stats> sysID_stats;
+    stats_snapshot published_stats;
+    void publishStats();
+
+    void updateRouting(const mavframe &frame);
+
+    //remove dead systems and components from sysID_stats and tell the
+    //routing table about them
+    void checkForDeadSysID();
+    // Called on the strand once a system has timed out on the link, links
+    // which remember where systems are forget it here
+    virtual void onSystemDead(uint8_t) {};
+
+    // Accessor function for recently_received, false if the packet is a repeat.
+    // Only called on links with reject_repeat_packets set
+    bool record_incoming_packet(const mavframe &frame);
+    void record_packet_stats(const mavframe &frame);
+    void handleSiKRadioPacket(const mavframe &frame);
+
+    std::map<uint8_t, uint8_t> new_custom_msg_crcs;
 };
 
 #endif
@@ -0,0 +1,55 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * MONOTONIC CLOCK CLASS
+ * Time source for everything on the packet path that measures intervals
+ * (system timeouts, link delay, repeat detection). Times are microseconds on
+ * a monotonic clock, so stepping the wall clock (NTP, GPS time sync) can't
+ * expire every system at once. Links read the clock once per receive and
+ * stamp every packet parsed from it with that time.
+ * The source can be replaced, e.g. with virtualclock to run on simulated time.
+ */
+
+#include "monoclock.h"
+
+#include <chrono>
+
+std::atomic<monoclock::source_fn> monoclock::source {&monoclock::steadyNow};
+std::atomic<mono_time> virtualclock::current {0};
+
+void monoclock::setSource(source_fn fn)
+{
+    source.store(fn ? fn : &monoclock::steadyNow);
+}
+
+mono_time monoclock::steadyNow()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void virtualclock::install(mono_time start)
+{
+    current.store(start);
+    monoclock::setSource(&virtualclock::now);
+}
+
+void virtualclock::uninstall()
+{
+    monoclock::setSource(nullptr);
+}
+
+void virtualclock::set(mono_time time)
+{
+    current.store(time);
+}
+
+void virtualclock::advance(mono_time us)
+{
+    current.fetch_add(us);
+}
+
+mono_time virtualclock::now()
+{
+    return current.load();
+}
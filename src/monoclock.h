@@ -0,0 +1,59 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * MONOTONIC CLOCK CLASS
+ * Time source for everything on the packet path that measures intervals
+ * (system timeouts, link delay, repeat detection). Times are microseconds on
+ * a monotonic clock, so stepping the wall clock (NTP, GPS time sync) can't
+ * expire every system at once. Links read the clock once per receive and
+ * stamp every packet parsed from it with that time.
+ * The source can be replaced, e.g. with virtualclock to run on simulated time.
+ */
+#ifndef MONOCLOCK_H
+#define MONOCLOCK_H
+
+#include <stdint.h>
+#include <atomic>
+
+// Microseconds since an arbitrary point, only differences are meaningful
+typedef int64_t mono_time;
+
+#define MONO_US_PER_MS 1000
+#define MONO_US_PER_SEC 1000000
+
+class monoclock
+{
+public:
+    typedef mono_time (*source_fn)();
+
+    static mono_time now()
+    {
+        return source.load(std::memory_order_relaxed)();
+    }
+
+    // Use fn for all later reads, nullptr goes back to the steady clock
+    static void setSource(source_fn fn);
+
+    // The default source, std::chrono::steady_clock
+    static mono_time steadyNow();
+
+private:
+    static std::atomic<source_fn> source;
+};
+
+// Clock which only moves when told to. install() makes it the monoclock source
+class virtualclock
+{
+public:
+    static void install(mono_time start = 0);
+    static void uninstall();
+
+    static void set(mono_time time);
+    static void advance(mono_time us);
+    static mono_time now();
+
+private:
+    static std::atomic<mono_time> current;
+};
+
+#endif
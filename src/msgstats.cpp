@@ -0,0 +1,135 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * MESSAGE STATS CLASS
+ * Packets and bytes in each direction for every message ID on a link, with
+ * smoothed rates, to find which messages are using a link's bandwidth.
+ * Message IDs are turned into a dense index through a table built once from
+ * the dialect, so counting a packet is an array lookup and two increments.
+ * Counting and rate updates happen on the link's strand, anything may read.
+ */
+
+#include "msgstats.h"
+#include "mavhelper.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Message IDs below this are looked up directly, the rest count as unknown.
+// Every dialect message in use fits
+#define MSGSTATS_DIRECT_IDS 65536
+
+namespace
+{
+// Maps message IDs to dense indexes, built once from the dialect's message info
+struct msg_index_t
+{
+    uint16_t index[MSGSTATS_DIRECT_IDS];
+    // Message ID at each index, index 0 is for unknown messages
+    std::vector<uint32_t> msgids;
+
+    msg_index_t()
+    {
+        size_t count;
+        const mavlink_message_info_t *messages = dialectMessages(count);
+
+        std::fill(index, index + MSGSTATS_DIRECT_IDS, 0);
+        msgids.push_back(UINT32_MAX);
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t msgid = messages[i].msgid;
+            if (msgid < MSGSTATS_DIRECT_IDS && index[msgid] == 0)
+            {
+                index[msgid] = msgids.size();
+                msgids.push_back(msgid);
+            }
+        }
+    }
+};
+
+const msg_index_t msg_index;
+}
+
+msgstats::msgstats() :
+    counters(new message_counters[msg_index.msgids.size()])
+{
+}
+
+int msgstats::indexFor(uint32_t msgid)
+{
+    return msgid < MSGSTATS_DIRECT_IDS ? msg_index.index[msgid] : 0;
+}
+
+void msgstats::updateRates(mono_time now)
+{
+    if (last_update == 0)
+    {
+        last_update = now;
+        return;
+    }
+
+    double dt = (double)(now - last_update) / MONO_US_PER_SEC;
+    if (dt <= 0)
+        return;
+    last_update = now;
+
+    // Weight so a rate settles over the time constant whatever the interval
+    double alpha = 1.0 - std::exp(-dt / MSGSTATS_RATE_TIME_CONSTANT_S);
+    for (size_t i = 0; i < msg_index.msgids.size(); i++)
+    {
+        updateDirection(counters[i].in, dt, alpha);
+        updateDirection(counters[i].out, dt, alpha);
+    }
+}
+
+void msgstats::updateDirection(direction &dir, double dt, double alpha)
+{
+    uint64_t packets = dir.packets.load(std::memory_order_relaxed);
+    uint64_t bytes = dir.bytes.load(std::memory_order_relaxed);
+
+    double packet_rate = dir.packet_rate.load(std::memory_order_relaxed);
+    double byte_rate = dir.byte_rate.load(std::memory_order_relaxed);
+    packet_rate += alpha * ((packets - dir.last_packets) / dt - packet_rate);
+    byte_rate += alpha * ((bytes - dir.last_bytes) / dt - byte_rate);
+    dir.packet_rate.store(packet_rate, std::memory_order_relaxed);
+    dir.byte_rate.store(byte_rate, std::memory_order_relaxed);
+
+    dir.last_packets = packets;
+    dir.last_bytes = bytes;
+}
+
+std::vector<msgstats::talker> msgstats::top(size_t max_count) const
+{
+    std::vector<talker> talkers;
+    for (size_t i = 0; i < msg_index.msgids.size(); i++)
+    {
+        const message_counters &c = counters[i];
+        talker t;
+        t.msgid = msg_index.msgids[i];
+        t.packets_in = c.in.packets.load(std::memory_order_relaxed);
+        t.bytes_in = c.in.bytes.load(std::memory_order_relaxed);
+        t.packets_out = c.out.packets.load(std::memory_order_relaxed);
+        t.bytes_out = c.out.bytes.load(std::memory_order_relaxed);
+        if (t.packets_in == 0 && t.packets_out == 0)
+            continue;
+
+        t.packet_rate_in = c.in.packet_rate.load(std::memory_order_relaxed);
+        t.byte_rate_in = c.in.byte_rate.load(std::memory_order_relaxed);
+        t.packet_rate_out = c.out.packet_rate.load(std::memory_order_relaxed);
+        t.byte_rate_out = c.out.byte_rate.load(std::memory_order_relaxed);
+        talkers.push_back(t);
+    }
+
+    // Before the first rate update everything is at zero, fall back to totals
+    std::sort(talkers.begin(), talkers.end(), [](const talker &a, const talker &b)
+    {
+        double rate_a = a.byte_rate_in + a.byte_rate_out;
+        double rate_b = b.byte_rate_in + b.byte_rate_out;
+        if (rate_a != rate_b)
+            return rate_a > rate_b;
+        return a.bytes_in + a.bytes_out > b.bytes_in + b.bytes_out;
+    });
+    if (talkers.size() > max_count)
+        talkers.resize(max_count);
+    return talkers;
+}
@@ -0,0 +1,89 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * MESSAGE STATS CLASS
+ * Packets and bytes in each direction for every message ID on a link, with
+ * smoothed rates, to find which messages are using a link's bandwidth.
+ * Message IDs are turned into a dense index through a table built once from
+ * the dialect, so counting a packet is an array lookup and two increments.
+ * Counting and rate updates happen on the link's strand, anything may read.
+ */
+#ifndef MSGSTATS_H
+#define MSGSTATS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "mavframe.h"
+#include "monoclock.h"
+
+// Rates are smoothed over roughly this long
+#define MSGSTATS_RATE_TIME_CONSTANT_S 10.0
+
+class msgstats
+{
+public:
+    msgstats();
+
+    // Only the link's strand may record or update rates
+    void recordIn(const mavframe &frame)
+    {
+        count(counters[indexFor(frame.msgid)].in, frame.len);
+    }
+
+    void recordOut(const mavframe &frame)
+    {
+        count(counters[indexFor(frame.msgid)].out, frame.len);
+    }
+
+    // Folds the packets since the last call into the smoothed rates
+    void updateRates(mono_time now);
+
+    struct talker
+    {
+        uint32_t msgid; // UINT32_MAX for messages outside the dialect
+        uint64_t packets_in, bytes_in, packets_out, bytes_out;
+        double packet_rate_in, byte_rate_in, packet_rate_out, byte_rate_out;
+    };
+
+    // Up to max_count message IDs with the highest byte rate in and out
+    // combined, busiest first. Only messages seen on the link are listed
+    std::vector<talker> top(size_t max_count) const;
+
+private:
+    struct direction
+    {
+        std::atomic<uint64_t> packets{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<double> packet_rate{0};
+        std::atomic<double> byte_rate{0};
+        // Totals at the last rate update, strand only
+        uint64_t last_packets = 0;
+        uint64_t last_bytes = 0;
+    };
+
+    struct message_counters
+    {
+        direction in;
+        direction out;
+    };
+
+    std::unique_ptr<message_counters[]> counters;
+    mono_time last_update = 0;
+
+    static void count(direction &dir, uint16_t len)
+    {
+        // Single writer, so plain loads and stores are enough
+        dir.packets.store(dir.packets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        dir.bytes.store(dir.bytes.load(std::memory_order_relaxed) + len, std::memory_order_relaxed);
+    }
+
+    static void updateDirection(direction &dir, double dt, double alpha);
+
+    // Dense index of a message ID, 0 for anything not in the dialect
+    static int indexFor(uint32_t msgid);
+};
+
+#endif
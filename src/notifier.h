@@ -0,0 +1,63 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * NOTIFIER CLASS
+ * Lets any number of producer threads wake a single consumer thread as soon
+ * as they have queued work, so the consumer doesn't have to poll on a timer.
+ * The producer side is lock free unless the consumer is actually blocked.
+ */
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+class notifier
+{
+public:
+    // Called by producers after they have pushed to a queue
+    void notify()
+    {
+        pending.store(true);
+        // Only take the lock when the consumer is (about to be) blocked
+        if (waiting.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cond_.notify_one();
+        }
+    }
+
+    // Called by the consumer once its queues are empty. Busy waits for up to
+    // spin_us microseconds, then blocks until notified or the timeout expires.
+    // Returns true if it was notified.
+    bool wait(int spin_us, std::chrono::milliseconds timeout)
+    {
+        if (spin_us > 0)
+        {
+            auto spin_end = std::chrono::steady_clock::now() + std::chrono::microseconds(spin_us);
+            do
+            {
+                if (pending.exchange(false))
+                    return true;
+            }
+            while (std::chrono::steady_clock::now() < spin_end);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiting.store(true);
+        bool notified = cond_.wait_for(lock, timeout, [this] { return pending.load(); });
+        waiting.store(false);
+        pending.store(false);
+        return notified;
+    }
+
+private:
+    std::atomic<bool> pending{false};
+    std::atomic<bool> waiting{false};
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+#endif
@@ -0,0 +1,221 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * PRIORITY QUEUE CLASS
+ * A link's outgoing queue, split into one spsc queue per traffic class so
+ * commands don't wait behind a backed up telemetry stream. Frames are sorted
+ * into classes by message ID through a table built once from the dialect,
+ * shared by every link, and the few messages the link's priority settings
+ * move. The writer takes the highest class with anything
+ * waiting (strict), or shares the link between the classes by weight.
+ * Latest only messages keep one slot per (sysid, compid, msgid) stream: a new
+ * sample replaces one still waiting rather than queueing behind it, so a
+ * congested link sends the freshest state instead of falling further behind.
+ * The main loop pushes, the link's strand pops.
+ */
+
+#include "priorityqueue.h"
+
+#include <algorithm>
+#include "mavhelper.h"
+
+namespace
+{
+const char *class_names[TRAFFIC_CLASSES] = { "control", "heartbeat", "telemetry", "bulk" };
+
+// Messages outside telemetry, names the dialect doesn't have are skipped.
+// Control is kept to short one-off commands and their replies: control and
+// heartbeats skip the write backlog limit, so a high rate stream listed here
+// (setpoints, log blocks, RTK corrections) could fill the link's queue
+const struct
+{
+    const char *message;
+    traffic_class tclass;
+} default_classes[] =
+{
+    { "HEARTBEAT", traffic_class::HEARTBEAT },
+    { "COMMAND_LONG", traffic_class::CONTROL },
+    { "COMMAND_INT", traffic_class::CONTROL },
+    { "COMMAND_ACK", traffic_class::CONTROL },
+    { "COMMAND_CANCEL", traffic_class::CONTROL },
+    { "SET_MODE", traffic_class::CONTROL },
+    { "PARAM_SET", traffic_class::CONTROL },
+    { "PARAM_REQUEST_READ", traffic_class::CONTROL },
+    { "PARAM_REQUEST_LIST", traffic_class::CONTROL },
+    { "MISSION_COUNT", traffic_class::CONTROL },
+    { "MISSION_REQUEST", traffic_class::CONTROL },
+    { "MISSION_REQUEST_INT", traffic_class::CONTROL },
+    { "MISSION_REQUEST_LIST", traffic_class::CONTROL },
+    { "MISSION_ACK", traffic_class::CONTROL },
+    { "MISSION_SET_CURRENT", traffic_class::CONTROL },
+    { "MISSION_CLEAR_ALL", traffic_class::CONTROL },
+    { "CHANGE_OPERATOR_CONTROL", traffic_class::CONTROL },
+    { "REQUEST_DATA_STREAM", traffic_class::CONTROL },
+    { "PARAM_VALUE", traffic_class::BULK },
+    { "PARAM_EXT_VALUE", traffic_class::BULK },
+    { "MISSION_ITEM", traffic_class::BULK },
+    { "MISSION_ITEM_INT", traffic_class::BULK },
+    { "LOG_ENTRY", traffic_class::BULK },
+    { "LOG_DATA", traffic_class::BULK },
+    { "LOGGING_DATA", traffic_class::BULK },
+    { "LOGGING_DATA_ACKED", traffic_class::BULK },
+    { "REMOTE_LOG_DATA_BLOCK", traffic_class::BULK },
+    { "FILE_TRANSFER_PROTOCOL", traffic_class::BULK },
+    { "DATA_TRANSMISSION_HANDSHAKE", traffic_class::BULK },
+    { "ENCAPSULATED_DATA", traffic_class::BULK },
+};
+
+// Everything not listed above is telemetry. Built on first use rather than
+// at static initialisation
+const std::vector<traffic_class> &defaultTable()
+{
+    static const std::vector<traffic_class> table = []
+    {
+        size_t num_messages;
+        const mavlink_message_info_t *message_info = dialectMessages(num_messages);
+
+        uint32_t max_msgid = 0;
+        for (size_t i = 0; i < num_messages; i++)
+            max_msgid = std::max(max_msgid, message_info[i].msgid);
+
+        std::vector<traffic_class> classes(max_msgid + 1, traffic_class::TELEMETRY);
+        for (size_t i = 0; i < sizeof(default_classes) / sizeof(default_classes[0]); i++)
+        {
+            const mavlink_message_info_t *info = messageInfoByName(default_classes[i].message);
+            if (info)
+                classes[info->msgid] = default_classes[i].tclass;
+        }
+        return classes;
+    }();
+    return table;
+}
+}
+
+const char *trafficClassName(traffic_class tclass)
+{
+    return class_names[(int)tclass];
+}
+
+bool parseTrafficClass(const std::string &name, traffic_class &tclass)
+{
+    for (int i = 0; i < TRAFFIC_CLASSES; i++)
+    {
+        if (name == class_names[i])
+        {
+            tclass = (traffic_class)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+priorityqueue::priorityqueue(size_t capacity,
+                             const std::unordered_map<uint32_t, traffic_class> &overrides_,
+                             const std::vector<int> &weights_,
+                             const std::unordered_set<uint32_t> &latest_only_) :
+    defaults(defaultTable()),
+    latest_only(latest_only_),
+    weights(weights_)
+{
+    for (int i = 0; i < TRAFFIC_CLASSES; i++)
+        queues[i].reset(new boost::lockfree::spsc_queue<entry>(capacity));
+
+    // Only keep the settings which change a message's class
+    for (auto entry = overrides_.begin(); entry != overrides_.end(); ++entry)
+    {
+        traffic_class current = entry->first < defaults.size() ? defaults[entry->first] : traffic_class::TELEMETRY;
+        if (entry->second != current)
+            overrides[entry->first] = entry->second;
+    }
+}
+
+priorityqueue::~priorityqueue()
+{
+    // Samples waiting in slots are owned by the slot, not by a frame_ptr
+    for (auto slot = latest_slots.begin(); slot != latest_slots.end(); ++slot)
+    {
+        mavframe *waiting = slot->second->frame.exchange(nullptr);
+        if (waiting)
+            intrusive_ptr_release(waiting);
+    }
+}
+
+bool priorityqueue::push(const frame_ptr &frame, traffic_class tclass, frame_ptr &replaced)
+{
+    entry queued;
+    if (!isLatestOnly(frame->msgid))
+    {
+        queued.frame = frame;
+        return queues[(int)tclass]->push(queued);
+    }
+
+    uint64_t key = ((uint64_t)frame->msgid << 16) | (frame->sysid << 8) | frame->compid;
+    std::unique_ptr<latest_slot> &slot = latest_slots[key];
+    if (!slot)
+        slot.reset(new latest_slot());
+
+    // The slot takes over a reference to the frame
+    frame_ptr held = frame;
+    mavframe *previous = slot->frame.exchange(held.detach(), std::memory_order_acq_rel);
+    if (previous)
+    {
+        // The older sample hasn't been sent, its slot is already queued
+        replaced = frame_ptr(previous, false);
+        return true;
+    }
+
+    queued.latest = slot.get();
+    if (queues[(int)tclass]->push(queued))
+        return true;
+
+    // Nothing queued points at the slot, so the strand can't have touched
+    // it. Empty it again so the next sample queues the slot
+    intrusive_ptr_release(slot->frame.exchange(nullptr, std::memory_order_acq_rel));
+    return false;
+}
+
+void priorityqueue::take(entry &popped, frame_ptr &frame)
+{
+    if (popped.latest)
+        frame = frame_ptr(popped.latest->frame.exchange(nullptr, std::memory_order_acq_rel), false);
+    else
+        frame.swap(popped.frame);
+}
+
+bool priorityqueue::pop(frame_ptr &frame)
+{
+    entry popped;
+    if (weights.empty())
+    {
+        for (int i = 0; i < TRAFFIC_CLASSES; i++)
+        {
+            if (queues[i]->pop(popped))
+            {
+                take(popped, frame);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Every class with frames waiting earns its weight, the one furthest
+    // ahead sends and pays back the total. Over a busy period each class
+    // gets its share of frames, interleaved rather than in bursts
+    int best = -1;
+    int total = 0;
+    for (int i = 0; i < TRAFFIC_CLASSES; i++)
+    {
+        if (!queues[i]->read_available())
+            continue;
+        current[i] += weights[i];
+        total += weights[i];
+        if (best < 0 || current[i] > current[best])
+            best = i;
+    }
+    if (best < 0 || !queues[best]->pop(popped))
+        return false;
+
+    current[best] -= total;
+    take(popped, frame);
+    return true;
+}
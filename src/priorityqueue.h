@@ -0,0 +1,116 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * PRIORITY QUEUE CLASS
+ * A link's outgoing queue, split into one spsc queue per traffic class so
+ * commands don't wait behind a backed up telemetry stream. Frames are sorted
+ * into classes by message ID through a table built once from the dialect,
+ * shared by every link, and the few messages the link's priority settings
+ * move. The writer takes the highest class with anything
+ * waiting (strict), or shares the link between the classes by weight.
+ * Latest only messages keep one slot per (sysid, compid, msgid) stream: a new
+ * sample replaces one still waiting rather than queueing behind it, so a
+ * congested link sends the freshest state instead of falling further behind.
+ * The main loop pushes, the link's strand pops.
+ */
+#ifndef PRIORITYQUEUE_H
+#define PRIORITYQUEUE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include "mavframe.h"
+
+// Highest priority first
+enum class traffic_class : uint8_t
+{
+    CONTROL, // one-off commands and their replies
+    HEARTBEAT,
+    TELEMETRY, // everything not classified otherwise, including setpoint streams
+    BULK // parameter lists, missions, logs and file transfers
+};
+#define TRAFFIC_CLASSES 4
+
+// Config file and shell names of the classes, lower case
+const char *trafficClassName(traffic_class tclass);
+bool parseTrafficClass(const std::string &name, traffic_class &tclass);
+
+class priorityqueue
+{
+public:
+    // overrides_ replaces the default class of those message IDs. weights has
+    // one weight per class in priority order, empty for strict priority.
+    // latest_only_ lists the message IDs to keep only the newest sample of
+    priorityqueue(size_t capacity,
+                  const std::unordered_map<uint32_t, traffic_class> &overrides_,
+                  const std::vector<int> &weights_,
+                  const std::unordered_set<uint32_t> &latest_only_);
+    ~priorityqueue();
+
+    // Main loop only. False if the class queue is full. A latest only sample
+    // still waiting to be sent is swapped for frame and handed back in
+    // replaced, the queue doesn't grow
+    bool push(const frame_ptr &frame, traffic_class tclass, frame_ptr &replaced);
+
+    // Link strand only. False if every class is empty
+    bool pop(frame_ptr &frame);
+
+    traffic_class classOf(uint32_t msgid) const
+    {
+        if (!overrides.empty())
+        {
+            auto found = overrides.find(msgid);
+            if (found != overrides.end())
+                return found->second;
+        }
+        return msgid < defaults.size() ? defaults[msgid] : traffic_class::TELEMETRY;
+    }
+
+    bool isLatestOnly(uint32_t msgid) const
+    {
+        return !latest_only.empty() && latest_only.count(msgid);
+    }
+
+private:
+    // The newest unsent sample of one stream. The main loop swaps new
+    // samples in and the strand swaps it out, whoever finds it empty knows
+    // the slot isn't (main loop) or is no longer (strand) in a class queue
+    struct latest_slot
+    {
+        std::atomic<mavframe *> frame{nullptr};
+    };
+
+    // A frame, or the slot to take the newest sample from when it's sent
+    struct entry
+    {
+        frame_ptr frame;
+        latest_slot *latest = nullptr;
+    };
+
+    std::unique_ptr<boost::lockfree::spsc_queue<entry> > queues[TRAFFIC_CLASSES];
+    // Class of each message ID in the dialect, one table shared by every link
+    const std::vector<traffic_class> &defaults;
+    // The link's priority settings, usually none
+    std::unordered_map<uint32_t, traffic_class> overrides;
+
+    std::unordered_set<uint32_t> latest_only;
+    // Slots by (sysid, compid, msgid), only the main loop looks them up.
+    // Slots live as long as the queue so the strand never sees one freed
+    std::unordered_map<uint64_t, std::unique_ptr<latest_slot> > latest_slots;
+
+    // Weighted mode, smooth weighted round robin over the classes with
+    // frames waiting. Strand only
+    std::vector<int> weights;
+    int current[TRAFFIC_CLASSES] = {};
+
+    // Takes the frame out of a popped entry
+    static void take(entry &popped, frame_ptr &frame);
+};
+
+#endif
@@ -0,0 +1,44 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * RATE LIMITER CLASS
+ * Caps how often each message type is output on a link (rate_limit), with a
+ * send schedule per (sysid, msgid). A fast stream is decimated: the first
+ * packet at or after the next slot is sent and the rest are dropped. Slots
+ * are a period apart rather than a period after the last send, so jitter in
+ * when packets arrive doesn't slow the output below the limit. Nothing is
+ * held back, so what does go out is always the newest sample. Only the main
+ * loop thread uses a limiter.
+ */
+
+#include "ratelimiter.h"
+
+#include <algorithm>
+
+ratelimiter::ratelimiter(const std::unordered_map<uint32_t, float> &limits_)
+{
+    for (auto limit = limits_.begin(); limit != limits_.end(); ++limit)
+        limits[limit->first].period = (mono_time)(MONO_US_PER_SEC / limit->second);
+}
+
+bool ratelimiter::allow(const mavframe &frame)
+{
+    auto found = limits.find(frame.msgid);
+    if (found == limits.end())
+        return true;
+
+    // Measured at receive time so a backed up main loop doesn't let a burst
+    // through. Packets of one sysid from several links aren't in receive
+    // order, an early one just finds its slot hasn't come yet
+    message_limit &limit = found->second;
+    mono_time &next = limit.next_send[frame.sysid];
+    mono_time now = frame.ingress_time;
+    if (now < next)
+        return false;
+
+    // The slot after this one, however late this packet came. Catching up is
+    // limited to half a period, so after a gap two packets don't go out back
+    // to back
+    next = std::max(next + limit.period, now + limit.period / 2);
+    return true;
+}
@@ -0,0 +1,43 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * RATE LIMITER CLASS
+ * Caps how often each message type is output on a link (rate_limit), with a
+ * send schedule per (sysid, msgid). A fast stream is decimated: the first
+ * packet at or after the next slot is sent and the rest are dropped. Slots
+ * are a period apart rather than a period after the last send, so jitter in
+ * when packets arrive doesn't slow the output below the limit. Nothing is
+ * held back, so what does go out is always the newest sample. Only the main
+ * loop thread uses a limiter.
+ */
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <stdint.h>
+#include <unordered_map>
+
+#include "mavframe.h"
+#include "monoclock.h"
+
+class ratelimiter
+{
+public:
+    // limits maps message IDs to the most packets per second to output
+    ratelimiter(const std::unordered_map<uint32_t, float> &limits_);
+
+    // True if frame may be sent, taking the next slot for its sysid and
+    // msgid. Messages without a limit are always allowed
+    bool allow(const mavframe &frame);
+
+private:
+    struct message_limit
+    {
+        mono_time period = 0;
+        // Earliest receive time the next packet of each sysid may be sent at
+        mono_time next_send[256] = {};
+    };
+
+    std::unordered_map<uint32_t, message_limit> limits;
+};
+
+#endif
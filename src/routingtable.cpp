@@ -0,0 +1,206 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * ROUTING TABLE CLASS
+ * Keeps a bitmask (one bit per link_id) of the links each system ID and each
+ * (sysid, compid) pair has been seen on, and folds the per link output rules
+ * (up, sleep, output_only_from) into precomputed masks. Routing a packet is
+ * then a few mask ANDs instead of checking every link against every other link.
+ * Only the main loop thread touches the table.
+ */
+
+#include "routingtable.h"
+#include "mavhelper.h"
+
+routingtable::routingtable(std::vector<std::shared_ptr<mlink> > *links_)
+{
+    links = links_;
+    size_t num_links = links->size();
+
+    sysid_links.assign(256, boost::dynamic_bitset<>(num_links));
+    source_links.assign(256, boost::dynamic_bitset<>(num_links));
+    active_links.resize(num_links);
+    up_links.resize(num_links);
+    filtered_links.resize(num_links);
+    rate_limited_links.resize(num_links);
+    rate_limiters.resize(num_links);
+
+    // Output rules from the config file never change, fold them in once
+    for (auto link = links->begin(); link != links->end(); ++link)
+    {
+        const link_info &info = (*link)->info;
+        for (int sysid = 0; sysid < 256; sysid++)
+        {
+            // A zero in output_only_from means output from everyone
+            if (info.output_only_from[0] == 0 ||
+                    std::find(info.output_only_from.begin(),
+                              info.output_only_from.end(),
+                              sysid) != info.output_only_from.end())
+            {
+                source_links[sysid].set((*link)->link_id);
+            }
+        }
+
+        if (info.filter_type != link_filter_type::NONE)
+            filtered_links.set((*link)->link_id);
+
+        if (!info.rate_limits.empty())
+        {
+            rate_limited_links.set((*link)->link_id);
+            rate_limiters[(*link)->link_id].reset(new ratelimiter(info.rate_limits));
+        }
+    }
+
+    update();
+}
+
+void routingtable::update()
+{
+    long max_delay = 0;
+    for (auto link = links->begin(); link != links->end(); ++link)
+    {
+        int id = (*link)->link_id;
+
+        // Systems and components the link has seen come and go, applied
+        // in the order they happened
+        route_update change;
+        while ((*link)->qReadRouteUpdate(&change))
+        {
+            uint8_t sysid = change.component >> 8;
+            auto found = component_links.find(change.component);
+            switch (change.kind)
+            {
+            case route_update::COMPONENT_SEEN:
+                sysid_links[sysid].set(id);
+                if (found == component_links.end())
+                    found = component_links.emplace(change.component, boost::dynamic_bitset<>(links->size())).first;
+                found->second.set(id);
+                break;
+
+            case route_update::COMPONENT_DEAD:
+                if (found != component_links.end())
+                    found->second.reset(id);
+                break;
+
+            case route_update::SYSTEM_DEAD:
+                sysid_links[sysid].reset(id);
+                // A dead system takes all of its components with it
+                for (int compid = 0; compid < 256; compid++)
+                {
+                    found = component_links.find(component_key(sysid, compid));
+                    if (found != component_links.end())
+                        found->second.reset(id);
+                }
+                break;
+            }
+        }
+
+        updateSleep(**link);
+
+        // Link state can be changed by the shell at any time, so take a
+        // fresh copy every iteration rather than on every packet
+        active_links[id] = !(*link)->is_kill &&
+                           !((*link)->info.sleep_enabled && (*link)->sleep);
+        up_links[id] = (*link)->up;
+
+        max_delay = std::max(max_delay, (*link)->link_quality.link_delay.load());
+    }
+
+    // A repeat can arrive as late as the slowest link is behind the fastest
+    mlink::recently_received.setWindow(max_delay * 1000);
+}
+
+void routingtable::updateSleep(mlink &link)
+{
+    // Sleep mode enabled for this link
+    if (!link.info.sleep_enabled)
+        return;
+
+    // There are clients on the link, sleep mode enabled
+    if (link.num_systems.load() && link.sleep)
+    {
+        std::cout << "Sleep mode disabled on link: " << link.info.link_name << std::endl;
+        link.sleep = false;
+    }
+    // There are no clients on the link, sleep mode disabled
+    else if (!link.num_systems.load() && !link.sleep)
+    {
+        std::cout << "Sleep mode enabled on link: " << link.info.link_name << std::endl;
+        link.sleep = true;
+    }
+}
+
+void routingtable::route(const mavframe &frame, const mlink &incoming_link,
+                         boost::dynamic_bitset<> &send_mask, boost::dynamic_bitset<> &down_mask)
+{
+    // Don't forward SiK radio info
+    if (incoming_link.info.SiK_radio && frame.sysid == 51)
+    {
+        send_mask.reset();
+        down_mask.reset();
+        return;
+    }
+
+    // Assignment reuses the existing storage so this doesn't allocate
+    send_mask = active_links;
+    send_mask &= source_links[frame.sysid];
+
+    // If the packet came from this link, don't bother
+    send_mask.reset(incoming_link.link_id);
+
+    // heartbeats are always forwarded, everything else addressed to a
+    // specific system only goes where that system has been seen
+    if (frame.msgid != MAVLINK_MSG_ID_HEARTBEAT)
+    {
+        int16_t sysIDmsg = -1;
+        int16_t compIDmsg = -1;
+        getTargets(frame, sysIDmsg, compIDmsg);
+        if (sysIDmsg > 0)
+        {
+            // Addressed to one component: send only where that component
+            // lives. If it hasn't been seen yet fall back to the whole
+            // system so the vehicle can still pass it on
+            const boost::dynamic_bitset<> *target_links = &sysid_links[sysIDmsg];
+            if (compIDmsg > 0)
+            {
+                auto found = component_links.find(component_key(sysIDmsg, compIDmsg));
+                if (found != component_links.end() && found->second.any())
+                    target_links = &found->second;
+            }
+            send_mask &= *target_links;
+        }
+    }
+
+    // Message filters are per message type so can't be folded into a mask
+    for (size_t i = send_mask.find_first(); i != boost::dynamic_bitset<>::npos; i = send_mask.find_next(i))
+    {
+        if (!filtered_links[i])
+            continue;
+
+        const link_info &info = links->at(i)->info;
+        // The current message type is in the filter messages set
+        bool message_found = info.filter_messages.find(frame.msgid) != info.filter_messages.end();
+
+        if ((message_found && info.filter_type == link_filter_type::DROP) ||
+                (!message_found && info.filter_type == link_filter_type::ACCEPT))
+            send_mask.reset(i);
+    }
+
+    // Split off the links which would have been sent to but are down
+    down_mask = send_mask;
+    down_mask -= up_links;
+    send_mask &= up_links;
+
+    // Rate limits go last so a token is only used when the frame is sent
+    if (send_mask.intersects(rate_limited_links))
+    {
+        for (size_t i = send_mask.find_first(); i != boost::dynamic_bitset<>::npos; i = send_mask.find_next(i))
+        {
+            if (rate_limited_links[i] && !rate_limiters[i]->allow(frame))
+            {
+                send_mask.reset(i);
+                links->at(i)->drops.rate_limited.increment();
+            }
+        }
+    }
+}
@@ -0,0 +1,58 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * ROUTING TABLE CLASS
+ * Keeps a bitmask (one bit per link_id) of the links each system ID and each
+ * (sysid, compid) pair has been seen on, and folds the per link output rules
+ * (up, sleep, output_only_from) into precomputed masks. Routing a packet is
+ * then a few mask ANDs instead of checking every link against every other link.
+ * Only the main loop thread touches the table.
+ */
+#ifndef ROUTINGTABLE_H
+#define ROUTINGTABLE_H
+
+#include <vector>
+#include <memory>
+#include <boost/dynamic_bitset.hpp>
+
+#include "mlink.h"
+#include "ratelimiter.h"
+
+class routingtable
+{
+public:
+    // links must already be numbered by link_id
+    routingtable(std::vector<std::shared_ptr<mlink> > *links_);
+
+    // Apply systems learned by the links, expire dead systems and refresh
+    // the link state masks. Call once per main loop iteration
+    void update();
+
+    // Fill send_mask with the links frame should be queued on. Links the
+    // frame is routable to but which are down are left in down_mask
+    void route(const mavframe &frame, const mlink &incoming_link,
+               boost::dynamic_bitset<> &send_mask, boost::dynamic_bitset<> &down_mask);
+
+private:
+    std::vector<std::shared_ptr<mlink> > *links;
+
+    // Links each system ID is currently seen on, indexed by sysid
+    std::vector<boost::dynamic_bitset<> > sysid_links;
+    // Links each (sysid, compid) is currently seen on, by component_key
+    std::unordered_map<uint16_t, boost::dynamic_bitset<> > component_links;
+    // Links accepting output from each source sysid (output_only_from)
+    std::vector<boost::dynamic_bitset<> > source_links;
+    // Links which are not asleep or dead
+    boost::dynamic_bitset<> active_links;
+    // Links which have been set up from the shell
+    boost::dynamic_bitset<> up_links;
+    // Links with a message filter, these still need a per message check
+    boost::dynamic_bitset<> filtered_links;
+    // Links with rate limits and their limiters, by link_id
+    boost::dynamic_bitset<> rate_limited_links;
+    std::vector<std::unique_ptr<ratelimiter> > rate_limiters;
+
+    void updateSleep(mlink &link);
+};
+
+#endif
@@ -6,12 +6,13 @@
  */
 
 #include "serial.h"
+#include "serialtuning.h"
 
 serial::serial(const std::string& port,
                const std::string& baudrate,
                bool flowcontrol,
                link_info info_):
-    io_service_(), port_(io_service_), mlink(info_)
+    mlink(info_), port_(io_service_)
 {
 
 
@@ -22,8 +23,23 @@ serial::serial(const std::string& port,
         port_.open(port);
 
 
-        //configure the port
-        port_.set_option(boost::asio::serial_port_base::baud_rate((unsigned int)std::stoi(baudrate)));
+        //configure the port, asio only knows the standard rates so fall
+        //back to termios2 for anything else
+        try
+        {
+            port_.set_option(boost::asio::serial_port_base::baud_rate((unsigned int)std::stoi(baudrate)));
+        }
+        catch (boost::system::system_error &)
+        {
+            if (!setCustomBaudRate(port_.native_handle(), std::stoi(baudrate)))
+                throw;
+        }
+
+        // By default let about a second of data (10 bits a byte) wait to be sent
+        if (info.max_backlog <= 0)
+            info.max_backlog = std::stoi(baudrate) / 10;
+        bytes_per_second = std::max(1, std::stoi(baudrate) / 10);
+        write_ahead_bytes = std::max(1, bytes_per_second * SERIAL_WRITE_AHEAD_MS / 1000);
 
         if(flowcontrol)
         {
@@ -46,6 +62,11 @@ serial::serial(const std::string& port,
         port_.set_option(boost::asio::serial_port_base::stop_bits(
                              boost::asio::serial_port_base::stop_bits::one));
 
+        // Latency tuning, a port which doesn't support it still works
+        if (info.low_latency && !setLowLatency(port_.native_handle()))
+        {
+            std::cout << "Link: " << info.link_name << " could not set low_latency on " << port << std::endl;
+        }
     }
     catch (boost::system::system_error &error)
     {
@@ -54,55 +75,120 @@ serial::serial(const std::string& port,
         exitFlag = true;
     }
 
-    //Start the read and write threads
-    write_thread = boost::thread(&serial::runWriteThread, this);
-
     //Start the receive
-    port_.async_read_some(
-        boost::asio::buffer(data_in_, MAV_INCOMING_BUFFER_LENGTH),
-        boost::bind(&serial::handleReceiveFrom, this,
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
+    if (!exitFlag)
+        receive();
 
-    read_thread = boost::thread(&serial::runReadThread, this);
+    startIO();
 }
 
 serial::~serial()
 {
-    //Force run() to return then join thread
-    io_service_.stop();
-    read_thread.join();
-
-    //force write thread to return then join thread
-    exitFlag = true;
-    write_thread.join();
+    stopIO();
 
     //Debind
     port_.close();
 }
 
-void serial::send(uint8_t *buf, std::size_t buf_size)
+void serial::processAndSend(const frame_ptr &frame)
+{
+    //port failed to open, nothing to send on
+    if(exitFlag)
+        return;
+
+    bool should_drop = shouldDropPacket();
+    if(should_drop)
+        return;
+
+    msg_stats.recordOut(*frame);
+    pending.push_back(frame);
+    pending_bytes += frame->len;
+    write_backlog += frame->len;
+}
+
+bool serial::readyToSend()
 {
-    port_.write_some(
-        boost::asio::buffer(buf, buf_size));
+    // Enough for the next write, the running write drains again when it completes
+    if (pending_bytes >= write_ahead_bytes)
+        return false;
+
+    // A write completes once the kernel has the bytes, and the kernel (or
+    // a USB adapter) can hold most of a second at low baud rates. Frames
+    // left in qMavOut until that has gone out can still be overtaken.
+    // The kernel's queue only shrinks during a drain, so it is read once a
+    // drain and again only when the frames taken since use up the budget
+    if (!kernel_queued_read || kernel_queued + pending_bytes >= write_ahead_bytes)
+    {
+        // A port which can't report it counts as empty
+        kernel_queued = std::max(0, outputQueueBytes(port_.native_handle()));
+        kernel_queued_read = true;
+    }
+    if (kernel_queued + pending_bytes < write_ahead_bytes)
+        return true;
+
+    startDrainTimer(kernel_queued);
+    return false;
 }
 
-void serial::processAndSend(mavlink_message_t *msgToConvert)
+void serial::startDrainTimer(int queued_bytes)
 {
-    //pack into buf and get size_t
-    uint8_t tmplen = mavlink_msg_to_send_buffer(data_out_, msgToConvert);
-    //ERROR HANDLING?
+    if (drain_timer_armed)
+        return;
+    drain_timer_armed = true;
+
+    // Check again once the queue should be down to write_ahead_bytes
+    long wait_us = (long)(queued_bytes + pending_bytes - write_ahead_bytes) * 1000000 / bytes_per_second;
+    drain_timer.expires_from_now(boost::posix_time::microseconds(std::max(1000L, wait_us)));
+    drain_timer.async_wait(strand_.wrap(boost::bind(&serial::handleDrainTimer, this,
+                                                    boost::asio::placeholders::error)));
+}
 
-    bool should_drop = shouldDropPacket();
-    //send on serial
-    if(!should_drop)
-        send(data_out_, tmplen);
+void serial::handleDrainTimer(const boost::system::error_code& error)
+{
+    drain_timer_armed = false;
+    if (!error)
+        drainOutgoing();
+}
+
+void serial::flushOutgoing()
+{
+    // The next drain reads the kernel's queue afresh
+    kernel_queued_read = false;
+    startWrite();
+}
+
+void serial::startWrite()
+{
+    if (write_in_progress || pending.empty())
+        return;
+
+    // Everything queued so far goes out in one write, straight from the frames
+    writing.swap(pending);
+    writing_bytes = pending_bytes;
+    pending_bytes = 0;
+    write_in_progress = true;
+
+    std::vector<boost::asio::const_buffer> buffers;
+    buffers.reserve(writing.size());
+    for (auto frame = writing.begin(); frame != writing.end(); ++frame)
+        buffers.push_back(boost::asio::buffer((*frame)->data, (*frame)->len));
+
+    // async_write keeps going until every byte is out, so partial writes
+    // at low baud rates don't lose the tail of a frame
+    boost::asio::async_write(port_, buffers,
+                             strand_.wrap(boost::bind(&serial::handleSendTo, this,
+                                                      boost::asio::placeholders::error,
+                                                      boost::asio::placeholders::bytes_transferred)));
 }
 
 //Async post send callback
 void serial::handleSendTo(const boost::system::error_code& error,
                           size_t bytes_recvd)
 {
+    write_in_progress = false;
+    writing.clear();
+    write_backlog -= writing_bytes;
+
     if (!error && bytes_recvd > 0)
     {
         //Everything was ok
@@ -117,80 +203,48 @@ void serial::handleSendTo(const boost::system::error_code& error,
             std::cout << "Link " << info.link_name << " is dead" << std::endl;
         }
     }
+
+    //Take the next frames off the outgoing queue, highest priority first,
+    //and send them with whatever was pending
+    drainOutgoing();
+}
+
+void serial::receive()
+{
+    // Completes as soon as there is data, there is nothing to poll for
+    port_.async_read_some(
+        boost::asio::buffer(data_in_, MAV_INCOMING_BUFFER_LENGTH),
+        strand_.wrap(boost::bind(&serial::handleReceiveFrom, this,
+                                 boost::asio::placeholders::error,
+                                 boost::asio::placeholders::bytes_transferred)));
 }
 
 //Async callback receiver
 void serial::handleReceiveFrom(const boost::system::error_code& error,
                                size_t bytes_recvd)
 {
-    if (!error && bytes_recvd > 0)
+    if (!error)
     {
         //message received
-        //do something
-        mavlink_message_t msg;
-        mavlink_status_t status;
-
-        for (size_t i = 0; i < bytes_recvd; i++)
-        {
-            if (mavlink_parse_char(MAVLINK_COMM_0, data_in_[i], &msg, &status))
-            {
-                onMessageRecv(&msg);
-            }
-        }
+        rx_time = monoclock::now();
+        parseIncoming(data_in_, bytes_recvd);
 
         //And start reading again
-        port_.async_read_some(
-            boost::asio::buffer(data_in_, MAV_INCOMING_BUFFER_LENGTH),
-            boost::bind(&serial::handleReceiveFrom, this,
-                        boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred));
-    }
-    else if(bytes_recvd == 0)
-    {
-        //Sleep a little bit to keep the cpu cool
-        boost::this_thread::sleep(boost::posix_time::milliseconds(SERIAL_PORT_SLEEP_ON_NOTHING_RECEIVED));
-        port_.async_read_some(
-            boost::asio::buffer(data_in_, MAV_INCOMING_BUFFER_LENGTH),
-            boost::bind(&serial::handleReceiveFrom, this,
-                        boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred));
+        receive();
     }
-    else
+    else if (error != boost::asio::error::operation_aborted)
     {
         //we have an error
         //need to look into what is causing these but for now just pretend it didn't happen
-        boost::this_thread::sleep(boost::posix_time::milliseconds(SERIAL_PORT_SLEEP_ON_NOTHING_RECEIVED));
-        port_.async_read_some(
-            boost::asio::buffer(data_in_, MAV_INCOMING_BUFFER_LENGTH),
-            boost::bind(&serial::handleReceiveFrom, this,
-                        boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred));
+        //and try again shortly, without blocking the thread
+        retry_timer.expires_from_now(boost::posix_time::milliseconds(SERIAL_PORT_RETRY_AFTER_ERROR_MS));
+        retry_timer.async_wait(strand_.wrap(boost::bind(&serial::handleRetryTimer, this,
+                                                        boost::asio::placeholders::error)));
     }
 }
 
-void serial::runReadThread()
-{
-    //gets run in thread
-    //Because io_service.run() will block while socket is open
-    io_service_.run();
-}
-
-void serial::runWriteThread()
+void serial::handleRetryTimer(const boost::system::error_code& error)
 {
-    //block so we dont send before the port is initialized
-    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
-    //busy wait on the spsc_queue
-    mavlink_message_t tmpMsg;
-
-    //thread loop
-    while(!exitFlag)
-    {
-        while(qMavOut.pop(tmpMsg))
-        {
-            out_counter.decrement();
-            processAndSend(&tmpMsg);
-        }
-        //queue is empty sleep the write thread
-        boost::this_thread::sleep(boost::posix_time::milliseconds(OUT_QUEUE_EMPTY_SLEEP));
-    }
+    if (!error)
+        receive();
 }
@@ -8,12 +8,17 @@
 #define SERIAL_H
 
 #include <string>
+#include <vector>
 #include <boost/asio.hpp>
 
 #include "mlink.h"
 
-#define SERIAL_PORT_SLEEP_ON_NOTHING_RECEIVED 2
+#define SERIAL_PORT_RETRY_AFTER_ERROR_MS 2
 #define SERIAL_PORT_MAX_ERROR_BEFORE_KILL 20
+// Frames are taken off the outgoing queue once less than this much data is
+// waiting in the kernel and our own pending write, so a control frame never
+// waits behind much more than this
+#define SERIAL_WRITE_AHEAD_MS 10
 
 class serial: public mlink
 {
@@ -25,29 +30,55 @@ public:
            link_info info_);
     ~serial();
 
-    //override virtuals from mlink
-    void runWriteThread();
-    void runReadThread();
-
 private:
     //Callbacks for async send/recv
+    void receive(); //Starts a async read
     void handleReceiveFrom(const boost::system::error_code& error,
                            size_t bytes_recvd);
+    // Read errors are retried after a short wait without holding up the thread
+    boost::asio::deadline_timer retry_timer {io_service_};
+    void handleRetryTimer(const boost::system::error_code& error);
     void handleSendTo(const boost::system::error_code& error,
                       size_t bytes_recvd);
 
     mavlink_message_t getMavMsg();
 
-    boost::asio::io_service io_service_;
     boost::asio::serial_port port_;
 
     int errorcount = 0;
 
-    //takes message, puts onto buff and calls send
-    void processAndSend(mavlink_message_t *msgToConvert);
+    //takes a serialised frame and queues it for the next write
+    void processAndSend(const frame_ptr &frame) override;
+
+    //starts a write of everything queued by processAndSend
+    void flushOutgoing() override;
+
+    // False once pending and the kernel's output queue hold
+    // SERIAL_WRITE_AHEAD_MS of data
+    bool readyToSend() override;
+
+    // Drains again once the kernel's output queue should have emptied,
+    // nothing else would as the write that filled it has already completed
+    boost::asio::deadline_timer drain_timer {io_service_};
+    bool drain_timer_armed = false;
+    void startDrainTimer(int queued_bytes);
+    void handleDrainTimer(const boost::system::error_code& error);
+
+    // Frames waiting for the current write to finish, and the frames
+    // the current write is sending
+    std::vector<frame_ptr> pending;
+    std::vector<frame_ptr> writing;
+    int pending_bytes = 0;
+    int writing_bytes = 0;
+    int write_ahead_bytes = 1;
+    // The kernel's output queue as last read in this drain
+    int kernel_queued = 0;
+    bool kernel_queued_read = false;
+    int bytes_per_second = 1;
+    bool write_in_progress = false;
 
-    //Actually sends
-    void send(uint8_t *buf, std::size_t buf_size);
+    // Writes everything pending in one async_write if no write is running
+    void startWrite();
 
 };
 
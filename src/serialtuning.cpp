@@ -0,0 +1,69 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * SERIAL TUNING
+ * Port settings asio has no option for: custom baud rates through termios2
+ * and the kernel low latency flag, plus how much output the kernel is
+ * still holding.
+ * Kept apart from serial.cpp because the termios2 headers clash with the
+ * <termios.h> that asio includes. These are Linux only, elsewhere they fail.
+ */
+
+#include "serialtuning.h"
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+
+bool setCustomBaudRate(int fd, int baud)
+{
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+        return false;
+
+    // BOTHER takes the rate from c_ispeed/c_ospeed instead of a Bxxx constant
+    tio.c_cflag &= ~CBAUD;
+    tio.c_cflag |= BOTHER;
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+    return ioctl(fd, TCSETS2, &tio) == 0;
+}
+
+bool setLowLatency(int fd)
+{
+    struct serial_struct serinfo;
+    if (ioctl(fd, TIOCGSERIAL, &serinfo) < 0)
+        return false;
+
+    serinfo.flags |= ASYNC_LOW_LATENCY;
+    return ioctl(fd, TIOCSSERIAL, &serinfo) == 0;
+}
+
+int outputQueueBytes(int fd)
+{
+    int queued;
+    if (ioctl(fd, TIOCOUTQ, &queued) < 0)
+        return -1;
+    return queued;
+}
+
+#else
+
+bool setCustomBaudRate(int, int)
+{
+    return false;
+}
+
+bool setLowLatency(int)
+{
+    return false;
+}
+
+int outputQueueBytes(int)
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,26 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * SERIAL TUNING
+ * Port settings asio has no option for: custom baud rates through termios2
+ * and the kernel low latency flag, plus how much output the kernel is
+ * still holding.
+ * Kept apart from serial.cpp because the termios2 headers clash with the
+ * <termios.h> that asio includes. These are Linux only, elsewhere they fail.
+ */
+#ifndef SERIALTUNING_H
+#define SERIALTUNING_H
+
+// Sets any baud rate the driver supports, not just the standard ones.
+// Returns false if it couldn't be set
+bool setCustomBaudRate(int fd, int baud);
+
+// Turns on ASYNC_LOW_LATENCY, on FTDI style USB adapters this takes the
+// latency timer down from 16ms. Returns false if the driver refused
+bool setLowLatency(int fd);
+
+// Bytes written to the port which the kernel and driver haven't sent yet
+// (TIOCOUTQ), -1 if it can't tell
+int outputQueueBytes(int fd);
+
+#endif
@@ -1,4 +1,5 @@
 #include "shell.h"
+#include "mavhelper.h"
 
 void runShell(bool &exitMainLoop, std::vector<std::shared_ptr<mlink> > &links)
 {
@@ -24,6 +25,8 @@ void executeLine(char *line, bool &exitMainLoop, std::vector<std::shared_ptr<mli
         printLinkStats(&links);
     else if(!linestring.compare("linkquality"))
         printLinkQuality(&links);
+    else if(!linestring.compare("latency"))
+        printLatency(&links);
     else if(!linestring.compare("quit"))
         exitMainLoop = true;
     else if(!linestring.compare("help"))
@@ -31,7 +34,9 @@ void executeLine(char *line, bool &exitMainLoop, std::vector<std::shared_ptr<mli
         std::cout << "Supported commands:" <<std::endl;
         std::cout << "\tstat\t\t\tgive link stats and system ids on each line." <<std::endl;
         std::cout << "\tlinkquality\t\tgive link quality stats for each link." << std::endl;
+        std::cout << "\tlatency\t\t\tgive forwarding latency percentiles for each pair of links." << std::endl;
         std::cout << "\tpacket <link>\t\tlist packet count for the link." <<std::endl;
+        std::cout << "\ttop <link>\t\tlist the message types using the most bandwidth on the link." <<std::endl;
         std::cout << "\tdown <link>\t\tstop sending on this link." <<std::endl;
         std::cout << "\tup <link>\t\tstart sending on this link." <<std::endl;
         std::cout << "\tquit" <<std::endl;
@@ -80,6 +85,28 @@ void executeLine(char *line, bool &exitMainLoop, std::vector<std::shared_ptr<mli
             std::cout << "up requires parameters" << std::endl;
         }
 
+    }
+    else if(!linestring.compare(0,3,"top"))
+    {
+        if(linestring.size() >= 5)
+        {
+            std::string link_to_do = linestring.substr(4,std::string::npos);
+
+            std::shared_ptr<mlink> linkfound;
+
+            if(findlink(link_to_do, &linkfound, links))
+            {
+
+                printTopTalkers(*linkfound);
+            }
+            else std::cout << "Link " << link_to_do << " not found" << std::endl;
+
+        }
+        else
+        {
+            std::cout << "top requires parameters (link number or name)" << std::endl;
+        }
+
     }
     else if(!linestring.compare(0,6,"packet"))
     {
@@ -177,19 +204,24 @@ void printLinkStats(std::vector<std::shared_ptr<mlink> > *links)
             buffer << "DOWN ";
         }
 
-        buffer << "Received: " << (*curr_link)->totalPacketCount << " "
-               << "Sent: " << (*curr_link)->totalPacketSent << " "
+        buffer << "Received: " << (*curr_link)->totalPacketCount.get() << " "
+               << "Queued: " << (*curr_link)->totalPacketQueued.get() << " "
                << "Systems on link: ";
 
-        std::map<uint8_t, mlink::packet_stats>* sysID_map = &((*curr_link)->sysID_stats);
+        mlink::stats_snapshot stats = (*curr_link)->statsSnapshot();
 
-        for(auto iter = sysID_map->begin(); iter != sysID_map->end(); iter++)
+        for(auto iter = stats->begin(); iter != stats->end(); iter++)
         {
-            buffer << (int)iter->first << " ";
+            buffer << (int)iter->sysid << " ";
         }
 
         buffer << "InQueue: " << (*curr_link)->in_counter.get();
         buffer << " OutQueue: " << (*curr_link)->out_counter.get();
+        if ((*curr_link)->info.max_backlog > 0)
+        {
+            buffer << " Backlog: " << (*curr_link)->write_backlog.load() << "B"
+                   << " Dropped: " << (*curr_link)->backlog_drops.load();
+        }
         boost::asio::ip::udp::endpoint *ep = (*curr_link)->sender_endpoint();
         if (ep)
         {
@@ -214,7 +246,7 @@ void printLinkQuality(std::vector<std::shared_ptr<mlink> > *links)
         if ((*curr_link)->info.SiK_radio)
         {
             buffer  << std::setw(17)
-                    << "Link delay: "<< std::setw(5) << (*curr_link)->link_quality.link_delay << " s\n"
+                    << "Link delay: "<< std::setw(5) << (*curr_link)->link_quality.link_delay.load() << " s\n"
                     << std::setw(17)
                     << "Local RSSI: " << std::setw(5) << (*curr_link)->link_quality.local_rssi
                     << std::setw(23)
@@ -230,25 +262,26 @@ void printLinkQuality(std::vector<std::shared_ptr<mlink> > *links)
                     << std::setw(17)
                     << "TX buffer: " << std::setw(5) << (*curr_link)->link_quality.tx_buffer << "%\n\n";
         }
-        if ((*curr_link)->sysID_stats.size() != 0)
+        mlink::stats_snapshot stats = (*curr_link)->statsSnapshot();
+        if (stats->size() != 0)
             buffer << std::setw(15) <<"System ID"
                    << std::setw(19) <<"Packets Lost"
                    << std::setw(19) <<"Packets Dropped"
                    << std::setw(19) <<"Packet Loss %" << "\n";
-        for (auto iter = (*curr_link)->sysID_stats.begin(); iter != (*curr_link)->sysID_stats.end(); ++iter)
+        for (auto iter = stats->begin(); iter != stats->end(); ++iter)
         {
-            if ((*curr_link)->info.SiK_radio && iter->first == 51)
+            if ((*curr_link)->info.SiK_radio && iter->sysid == 51)
             {
                 buffer << std::setw(11) << "(SiK)"
-                       << std::setw(4) << (int)iter->first;
+                       << std::setw(4) << (int)iter->sysid;
             }
             else
             {
-                buffer << std::setw(15) << (int)iter->first;
+                buffer << std::setw(15) << (int)iter->sysid;
             }
-            buffer << std::setw(19) << iter->second.packets_lost
-                   << std::setw(19) << iter->second.packets_dropped
-                   << std::setw(19) << iter->second.packet_loss_percent << "\n";
+            buffer << std::setw(19) << iter->packets_lost
+                   << std::setw(19) << iter->packets_dropped
+                   << std::setw(19) << iter->packet_loss_percent << "\n";
 
         }
     }
@@ -258,3 +291,70 @@ void printLinkQuality(std::vector<std::shared_ptr<mlink> > *links)
 
 }
 
+
+void printLatency(std::vector<std::shared_ptr<mlink> > *links)
+{
+    // One line per pair of links a frame has been forwarded between
+    std::ostringstream buffer;
+    buffer << std::setw(15) << "From"
+           << std::setw(15) << "To"
+           << std::setw(12) << "Frames"
+           << std::setw(12) << "p50 (us)"
+           << std::setw(12) << "p99 (us)"
+           << std::setw(12) << "p99.9 (us)"
+           << std::setw(12) << "Max (us)" << "\n";
+    for (auto out_link = links->begin(); out_link != links->end(); ++out_link)
+    {
+        for (size_t in_id = 0; in_id < (*out_link)->numLatencySources(); in_id++)
+        {
+            const latencyhistogram *found = (*out_link)->latencyFrom(in_id);
+            if (!found || found->count() == 0)
+                continue;
+            const latencyhistogram &histogram = *found;
+
+            buffer << std::setw(15) << links->at(in_id)->info.link_name
+                   << std::setw(15) << (*out_link)->info.link_name
+                   << std::setw(12) << histogram.count()
+                   << std::setw(12) << histogram.percentile(0.5)
+                   << std::setw(12) << histogram.percentile(0.99)
+                   << std::setw(12) << histogram.percentile(0.999)
+                   << std::setw(12) << histogram.max() << "\n";
+        }
+    }
+    std::cout << "---------------------------------------------------------------------------------------\n"
+              << buffer.str()
+              << "---------------------------------------------------------------------------------------" << std::endl;
+}
+
+void printTopTalkers(mlink &link)
+{
+    std::vector<msgstats::talker> talkers = link.msg_stats.top(SHELL_TOP_TALKERS);
+
+    std::ostringstream buffer;
+    buffer << std::fixed << std::setprecision(1);
+    buffer << std::setw(8) << "Msg ID"
+           << std::setw(30) << "Name"
+           << std::setw(11) << "In pkt/s"
+           << std::setw(11) << "In B/s"
+           << std::setw(11) << "Out pkt/s"
+           << std::setw(11) << "Out B/s"
+           << std::setw(12) << "In bytes"
+           << std::setw(12) << "Out bytes" << "\n";
+    for (auto talker = talkers.begin(); talker != talkers.end(); ++talker)
+    {
+        const mavlink_message_info_t *message_info = messageInfoById(talker->msgid);
+        if (talker->msgid == UINT32_MAX)
+            buffer << std::setw(8) << "-" << std::setw(30) << "(not in dialect)";
+        else
+            buffer << std::setw(8) << talker->msgid
+                   << std::setw(30) << (message_info ? message_info->name : "?");
+        buffer << std::setw(11) << talker->packet_rate_in
+               << std::setw(11) << talker->byte_rate_in
+               << std::setw(11) << talker->packet_rate_out
+               << std::setw(11) << talker->byte_rate_out
+               << std::setw(12) << talker->bytes_in
+               << std::setw(12) << talker->bytes_out << "\n";
+    }
+    std::cout << "TOP MESSAGES FOR LINK: " << link.info.link_name << "\n"
+              << buffer.str() << std::flush;
+}
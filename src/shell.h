@@ -8,6 +8,9 @@
 #include <readline/readline.h>
 #include <readline/history.h>
 
+// Message types listed by the top command
+#define SHELL_TOP_TALKERS 10
+
 void runShell(bool &exitMainLoop, std::vector<std::shared_ptr<mlink> > &links);
 void executeLine(char *line, bool &exitMainLoop,
                  std::vector<std::shared_ptr<mlink> > &links);
@@ -15,6 +18,8 @@ void printLinkStats(std::vector<std::shared_ptr<mlink> > *links);
 int findlink(std::string link_string, std::shared_ptr<mlink>* prt,
              std::vector<std::shared_ptr<mlink> > &links);
 void printLinkQuality(std::vector<std::shared_ptr<mlink> > *links);
+void printLatency(std::vector<std::shared_ptr<mlink> > *links);
+void printTopTalkers(mlink &link);
 
 extern std::vector<std::shared_ptr<mlink>> links;
 
@@ -0,0 +1,402 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * TCP CLASS
+ * This class extends 'link' and overrides it methods to handle tcp communications
+ * As a client it connects to a server and reconnects whenever the connection drops.
+ * As a server it accepts any number of clients, each with its own byte stream.
+ * Frames queued while a write is in progress are gathered into the next write,
+ * and a client which can't keep up has frames dropped rather than queued forever.
+ */
+
+#include "tcplink.h"
+#include "mavhelper.h"
+
+// Client constructor
+tcplink::tcplink(const std::string& host,
+                 const std::string& hostport,
+                 link_info info_) : mlink(info_), host_(host), hostport_(hostport)
+{
+    held_drain_frames = TCP_MAX_HELD_FRAMES;
+
+    connect();
+
+    startIO();
+}
+
+// Server constructor
+tcplink::tcplink(const std::string& listenport,
+                 link_info info_) : mlink(info_)
+{
+    is_server = true;
+    held_drain_frames = TCP_MAX_HELD_FRAMES;
+
+    listen_endpoint_ = boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), std::stoi(listenport));
+    listen();
+
+    startIO();
+}
+
+tcplink::~tcplink()
+{
+    stopIO();
+
+    //Debind
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
+    for (auto conn = connections.begin(); conn != connections.end(); ++conn)
+    {
+        (*conn)->socket.close(ignored);
+    }
+}
+
+void tcplink::connect()
+{
+    // Resolve once, reconnects go back to the same address. A host which
+    // doesn't resolve yet is tried again on the reconnect timer
+    if (!resolved)
+    {
+        boost::asio::ip::tcp::resolver::query query(boost::asio::ip::tcp::v4(), host_, hostport_);
+        resolver_.async_resolve(query,
+                                strand_.wrap(boost::bind(&tcplink::handleResolve, this,
+                                                         boost::asio::placeholders::error,
+                                                         boost::asio::placeholders::iterator)));
+        return;
+    }
+
+    connection_ptr conn = std::make_shared<tcp_connection>(io_service_);
+    conn->name = endpoint_.address().to_string() + ":" + std::to_string(endpoint_.port());
+    connections.push_back(conn);
+
+    conn->socket.async_connect(endpoint_,
+                               strand_.wrap(boost::bind(&tcplink::handleConnect, this, conn,
+                                                        boost::asio::placeholders::error)));
+}
+
+void tcplink::handleResolve(const boost::system::error_code& error,
+                            boost::asio::ip::tcp::resolver::iterator iter)
+{
+    if (error == boost::asio::error::operation_aborted)
+        return;
+
+    if (error || iter == boost::asio::ip::tcp::resolver::iterator())
+    {
+        std::cout << "Link: " << info.link_name << " could not resolve " << host_
+                  << ":" << hostport_ << ": " << error.message() << std::endl;
+        startReconnectTimer();
+        return;
+    }
+
+    endpoint_ = *iter;
+    resolved = true;
+    connect();
+}
+
+void tcplink::handleConnect(connection_ptr conn, const boost::system::error_code& error)
+{
+    if (error)
+    {
+        disconnect(conn);
+        return;
+    }
+
+    // Writes are already gathered here, don't let the kernel hold them back too
+    boost::system::error_code ignored;
+    conn->socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+    conn->connected = true;
+    std::cout << "Link: " << info.link_name << " connected to " << conn->name << std::endl;
+
+    receive(conn);
+}
+
+void tcplink::startReconnectTimer()
+{
+    reconnect_timer.expires_from_now(boost::posix_time::milliseconds(TCP_RECONNECT_INTERVAL_MS));
+    reconnect_timer.async_wait(strand_.wrap(boost::bind(&tcplink::handleReconnectTimer, this,
+                                                        boost::asio::placeholders::error)));
+}
+
+void tcplink::handleReconnectTimer(const boost::system::error_code& error)
+{
+    if (!error)
+        connect();
+}
+
+void tcplink::listen()
+{
+    // A port which is in use fails this link only, it keeps trying
+    boost::system::error_code error;
+    acceptor_.open(listen_endpoint_.protocol(), error);
+    if (!error)
+        acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), error);
+    if (!error)
+        acceptor_.bind(listen_endpoint_, error);
+    if (!error)
+        acceptor_.listen(boost::asio::socket_base::max_connections, error);
+
+    if (error)
+    {
+        std::cout << "Link: " << info.link_name << " could not listen on port "
+                  << listen_endpoint_.port() << ": " << error.message() << std::endl;
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        startAcceptTimer();
+        return;
+    }
+
+    accept();
+}
+
+void tcplink::accept()
+{
+    connection_ptr conn = std::make_shared<tcp_connection>(io_service_);
+    acceptor_.async_accept(conn->socket,
+                           strand_.wrap(boost::bind(&tcplink::handleAccept, this, conn,
+                                                    boost::asio::placeholders::error)));
+}
+
+void tcplink::handleAccept(connection_ptr conn, const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted)
+        return;
+
+    if (!error)
+    {
+        boost::system::error_code ignored;
+        conn->socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+        boost::asio::ip::tcp::endpoint remote = conn->socket.remote_endpoint(ignored);
+        conn->name = remote.address().to_string() + ":" + std::to_string(remote.port());
+        conn->connected = true;
+        connections.push_back(conn);
+        std::cout << "Adding client: " << conn->name << " to link: " << info.link_name << std::endl;
+
+        receive(conn);
+        // The new client can take frames the others are holding back
+        drainOutgoing();
+    }
+    else
+    {
+        // Accepting again straight away would fail the same way in a busy loop
+        std::cout << "Link: " << info.link_name << " failed to accept a client: "
+                  << error.message() << std::endl;
+        startAcceptTimer();
+        return;
+    }
+
+    //And wait for the next client
+    accept();
+}
+
+void tcplink::startAcceptTimer()
+{
+    accept_timer.expires_from_now(boost::posix_time::milliseconds(TCP_ACCEPT_RETRY_MS));
+    accept_timer.async_wait(strand_.wrap(boost::bind(&tcplink::handleAcceptTimer, this,
+                                                     boost::asio::placeholders::error)));
+}
+
+void tcplink::handleAcceptTimer(const boost::system::error_code& error)
+{
+    if (error)
+        return;
+
+    if (acceptor_.is_open())
+        accept();
+    else
+        listen();
+}
+
+void tcplink::disconnect(connection_ptr conn)
+{
+    // Reads and writes can both fail on the same connection, only act once
+    auto found = std::find(connections.begin(), connections.end(), conn);
+    if (found == connections.end())
+        return;
+    connections.erase(found);
+
+    boost::system::error_code ignored;
+    conn->socket.close(ignored);
+
+    if (conn->connected)
+    {
+        if (is_server)
+            std::cout << "Removing client: " << conn->name << " from link: " << info.link_name << std::endl;
+        else
+            std::cout << "Link: " << info.link_name << " lost connection to " << conn->name << std::endl;
+    }
+
+    // This may have been the peer holding up the outgoing queue
+    drainOutgoing();
+
+    if (!is_server)
+        startReconnectTimer();
+}
+
+void tcplink::receive(connection_ptr conn)
+{
+    conn->socket.async_read_some(
+        boost::asio::buffer(conn->data_in, MAV_INCOMING_BUFFER_LENGTH),
+        strand_.wrap(boost::bind(&tcplink::handleReceive, this, conn,
+                                 boost::asio::placeholders::error,
+                                 boost::asio::placeholders::bytes_transferred)));
+}
+
+//Async callback receiver
+void tcplink::handleReceive(connection_ptr conn,
+                            const boost::system::error_code& error,
+                            size_t bytes_recvd)
+{
+    if (error || bytes_recvd == 0)
+    {
+        //closed by the other end or there was an error
+        disconnect(conn);
+        return;
+    }
+
+    //message received, each connection is its own stream
+    current_connection = conn.get();
+    rx_time = monoclock::now();
+    parseIncoming(conn->data_in, bytes_recvd, conn->parser);
+    current_connection = nullptr;
+
+    //And start reading again
+    receive(conn);
+}
+
+void tcplink::onMessageRecv(const frame_ptr &frame)
+{
+    if (current_connection)
+        current_connection->sysids.set(frame->sysid);
+
+    mlink::onMessageRecv(frame);
+}
+
+void tcplink::onSystemDead(uint8_t sysid)
+{
+    for (auto conn = connections.begin(); conn != connections.end(); ++conn)
+        (*conn)->sysids.reset(sysid);
+}
+
+void tcplink::processAndSend(const frame_ptr &frame)
+{
+    bool should_drop = shouldDropPacket();
+    if (should_drop)
+        return;
+
+    // Addressed to one system: only the connections it sits behind get it,
+    // unless no connection has heard from it yet
+    int16_t sysIDmsg = -1;
+    int16_t compIDmsg = -1;
+    if (frame->msgid != MAVLINK_MSG_ID_HEARTBEAT)
+        getTargets(*frame, sysIDmsg, compIDmsg);
+
+    bool targeted = false;
+    if (sysIDmsg > 0)
+    {
+        for (auto conn = connections.begin(); conn != connections.end(); ++conn)
+            targeted |= (*conn)->sysids[sysIDmsg];
+    }
+    // Counted out once if any peer takes it
+    bool queued = false;
+    for (auto conn = connections.begin(); conn != connections.end(); ++conn)
+    {
+        if ((*conn)->connected && (!targeted || (*conn)->sysids[sysIDmsg]))
+            queued |= queueWrite(**conn, frame);
+    }
+    if (queued)
+        msg_stats.recordOut(*frame);
+}
+
+bool tcplink::queueWrite(tcp_connection &conn, const frame_ptr &frame)
+{
+    // The peer isn't reading fast enough, drop rather than buffer without limit
+    if (conn.backlogBytes() + frame->len > (size_t)info.tcp_max_pending_bytes)
+    {
+        if (!conn.dropping)
+        {
+            std::cout << "Link: " << info.link_name << " " << conn.name
+                      << " is not keeping up, dropping packets" << std::endl;
+            conn.dropping = true;
+        }
+        conn.dropped++;
+        drops.slow_peer.increment();
+        return false;
+    }
+
+    conn.pending.push_back(frame);
+    conn.pending_bytes += frame->len;
+    return true;
+}
+
+bool tcplink::readyToSend()
+{
+    // A slow peer doesn't hold the others back or fill the outgoing queue,
+    // it drops packets at tcp_max_pending instead
+    if (out_counter.get() >= TCP_MAX_HELD_FRAMES)
+        return true;
+    for (auto conn = connections.begin(); conn != connections.end(); ++conn)
+    {
+        if (!(*conn)->connected || (*conn)->pending_bytes < TCP_WRITE_AHEAD_BYTES)
+            return true;
+    }
+    return connections.empty();
+}
+
+void tcplink::flushOutgoing()
+{
+    for (auto conn = connections.begin(); conn != connections.end(); ++conn)
+    {
+        startWrite(*conn);
+    }
+}
+
+void tcplink::startWrite(connection_ptr conn)
+{
+    if (conn->write_in_progress || conn->pending.empty())
+        return;
+
+    // Everything queued so far goes out in one write, straight from the frames
+    conn->writing.swap(conn->pending);
+    conn->writing_bytes = conn->pending_bytes;
+    conn->pending_bytes = 0;
+    conn->write_in_progress = true;
+
+    std::vector<boost::asio::const_buffer> buffers;
+    buffers.reserve(conn->writing.size());
+    for (auto frame = conn->writing.begin(); frame != conn->writing.end(); ++frame)
+        buffers.push_back(boost::asio::buffer((*frame)->data, (*frame)->len));
+
+    boost::asio::async_write(conn->socket, buffers,
+                             strand_.wrap(boost::bind(&tcplink::handleWrite, this, conn,
+                                                      boost::asio::placeholders::error,
+                                                      boost::asio::placeholders::bytes_transferred)));
+}
+
+//Async post send callback
+void tcplink::handleWrite(connection_ptr conn,
+                          const boost::system::error_code& error,
+                          size_t)
+{
+    conn->write_in_progress = false;
+    conn->writing.clear();
+    conn->writing_bytes = 0;
+
+    if (error)
+    {
+        disconnect(conn);
+        return;
+    }
+
+    // Only once the backlog is well down, otherwise a peer sitting at the
+    // limit would flap between dropping and caught up on every write
+    if (conn->dropping && conn->backlogBytes() < (size_t)info.tcp_max_pending_bytes / TCP_CAUGHT_UP_DIVISOR)
+    {
+        std::cout << "Link: " << info.link_name << " " << conn->name << " caught up, "
+                  << conn->dropped << " packets dropped" << std::endl;
+        conn->dropping = false;
+        conn->dropped = 0;
+    }
+
+    //Take the next frames off the outgoing queue, highest priority first,
+    //and send them with whatever was pending
+    drainOutgoing();
+}
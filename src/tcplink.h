@@ -0,0 +1,151 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * TCP CLASS
+ * This class extends 'link' and overrides it methods to handle tcp communications
+ * As a client it connects to a server and reconnects whenever the connection drops.
+ * As a server it accepts any number of clients, each with its own byte stream.
+ * Frames queued while a write is in progress are gathered into the next write,
+ * and a client which can't keep up has frames dropped rather than queued forever.
+ */
+#ifndef TCPLINK_H
+#define TCPLINK_H
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <bitset>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mlink.h"
+
+#define TCP_RECONNECT_INTERVAL_MS 1000
+// How long to wait before accepting again after accept fails (out of file
+// descriptors and the like), rather than retrying straight away
+#define TCP_ACCEPT_RETRY_MS 1000
+// Frames stay in the outgoing queue, where higher priority frames can still
+// overtake them, once every peer has this much waiting for its next write
+#define TCP_WRITE_AHEAD_BYTES 4096
+// At most this many frames are held in the outgoing queue that way, past it
+// frames go on to the peers and one which isn't reading hits tcp_max_pending
+#define TCP_MAX_HELD_FRAMES (MAV_OUTGOING_LENGTH / 2)
+// A peer which was dropping packets has caught up once less than
+// tcp_max_pending / TCP_CAUGHT_UP_DIVISOR is waiting for it
+#define TCP_CAUGHT_UP_DIVISOR 2
+
+class tcplink: public mlink
+{
+public:
+    //Client, connects to host:hostport
+    tcplink(const std::string& host,
+            const std::string& hostport,
+            link_info info_);
+
+    //Server, accepts clients on listenport
+    tcplink(const std::string& listenport,
+            link_info info_);
+
+    ~tcplink();
+
+private:
+    struct tcp_connection
+    {
+        tcp_connection(boost::asio::io_service &io_service) : socket(io_service) {}
+
+        boost::asio::ip::tcp::socket socket;
+        std::string name;
+        bool connected = false;
+
+        uint8_t data_in[MAV_INCOMING_BUFFER_LENGTH];
+        mavparser parser;
+
+        // Frames waiting for the current write to finish, and the frames
+        // the current write is sending
+        std::vector<frame_ptr> pending;
+        std::vector<frame_ptr> writing;
+        size_t pending_bytes = 0;
+        size_t writing_bytes = 0;
+        bool write_in_progress = false;
+
+        // Bytes the peer hasn't taken yet, pending and being written
+        size_t backlogBytes() const
+        {
+            return pending_bytes + writing_bytes;
+        }
+
+        // Set once the backlog hits tcp_max_pending_bytes, until it drains
+        // below the low water mark
+        bool dropping = false;
+        long dropped = 0;
+
+        // System IDs heard from this peer
+        std::bitset<256> sysids;
+    };
+    typedef std::shared_ptr<tcp_connection> connection_ptr;
+
+    std::vector<connection_ptr> connections;
+    // Peer the frames being parsed came from
+    tcp_connection *current_connection = nullptr;
+
+    //Client side
+    bool is_server = false;
+    boost::asio::ip::tcp::resolver resolver_ {io_service_};
+    std::string host_;
+    std::string hostport_;
+    boost::asio::ip::tcp::endpoint endpoint_;
+    bool resolved = false;
+    boost::asio::deadline_timer reconnect_timer {io_service_};
+    void connect();
+    void handleResolve(const boost::system::error_code& error,
+                       boost::asio::ip::tcp::resolver::iterator iter);
+    void handleConnect(connection_ptr conn, const boost::system::error_code& error);
+    void startReconnectTimer();
+    void handleReconnectTimer(const boost::system::error_code& error);
+
+    //Server side
+    boost::asio::ip::tcp::endpoint listen_endpoint_;
+    boost::asio::ip::tcp::acceptor acceptor_ {io_service_};
+    // Also retries listen() while the acceptor isn't open
+    boost::asio::deadline_timer accept_timer {io_service_};
+    void listen();
+    void accept();
+    void handleAccept(connection_ptr conn, const boost::system::error_code& error);
+    void startAcceptTimer();
+    void handleAcceptTimer(const boost::system::error_code& error);
+
+    //Callbacks for async send/recv
+    void receive(connection_ptr conn);
+    void handleReceive(connection_ptr conn,
+                       const boost::system::error_code& error,
+                       size_t bytes_recvd);
+    void handleWrite(connection_ptr conn,
+                     const boost::system::error_code& error,
+                     size_t bytes_sent);
+
+    // Closes the connection, a client then starts reconnecting
+    void disconnect(connection_ptr conn);
+
+    // Adds a frame to a connection's pending writes, or drops it and returns
+    // false if the peer is too far behind
+    bool queueWrite(tcp_connection &conn, const frame_ptr &frame);
+    // Starts a write of everything pending if one isn't running already
+    void startWrite(connection_ptr conn);
+
+    //takes a serialised frame and queues it on the connections it is for
+    void processAndSend(const frame_ptr &frame) override;
+
+    //starts writes for everything queued by processAndSend
+    void flushOutgoing() override;
+
+    // True while any peer has less than TCP_WRITE_AHEAD_BYTES pending
+    bool readyToSend() override;
+
+    // Learns which systems are behind the current connection
+    void onMessageRecv(const frame_ptr &frame) override;
+    // Forgets a timed out system, it may come back behind another peer
+    void onSystemDead(uint8_t sysid) override;
+};
+
+#endif
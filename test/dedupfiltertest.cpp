@@ -0,0 +1,122 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * DUPLICATE FILTER TESTS
+ * Repeats inside the window, expiry after it, and buckets reused after a
+ * burst forgetting everything the burst put in them.
+ */
+
+#include "test.h"
+
+#include <string.h>
+#include <vector>
+
+#include "../src/dedupfilter.h"
+
+namespace
+{
+// Start of a bucket period, well away from zero
+const mono_time start = 1000 * (mono_time)DEDUP_BUCKET_MS * MONO_US_PER_MS;
+
+mono_time buckets(int n)
+{
+    return n * (mono_time)DEDUP_BUCKET_MS * MONO_US_PER_MS;
+}
+
+// Well spread hashes, so every shard gets some
+uint64_t nthHash(uint64_t n)
+{
+    uint64_t hash = (n + 1) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+void testRepeats()
+{
+    dedupfilter filter;
+    CHECK(filter.insert(nthHash(1), start));
+    CHECK(!filter.insert(nthHash(1), start));
+    CHECK(filter.insert(nthHash(2), start));
+    // Zero marks an empty slot, it is still remembered
+    CHECK(filter.insert(0, start));
+    CHECK(!filter.insert(0, start + 1));
+}
+
+void testWindow()
+{
+    dedupfilter filter;
+    int window = DEDUP_MIN_WINDOW_MS / DEDUP_BUCKET_MS;
+
+    CHECK(filter.insert(nthHash(1), start));
+    CHECK(!filter.insert(nthHash(1), start + buckets(window)));
+
+    CHECK(filter.insert(nthHash(2), start));
+    CHECK(filter.insert(nthHash(2), start + buckets(window + 1)));
+
+    // Shorter than the minimum is raised to it
+    filter.setWindow(10);
+    CHECK(filter.insert(nthHash(3), start));
+    CHECK(!filter.insert(nthHash(3), start + buckets(window)));
+
+    filter.setWindow(3000);
+    int longer = 3000 / DEDUP_BUCKET_MS;
+    CHECK(filter.insert(nthHash(4), start));
+    CHECK(!filter.insert(nthHash(4), start + buckets(longer)));
+    CHECK(filter.insert(nthHash(5), start));
+    CHECK(filter.insert(nthHash(5), start + buckets(longer + 1)));
+}
+
+void testBucketReuse()
+{
+    dedupfilter filter;
+    filter.setWindow(60000);
+
+    // A burst grows the bucket's tables
+    const int burst = 20000;
+    for (int i = 0; i < burst; i++)
+        CHECK(filter.insert(nthHash(i), start));
+
+    // A full lap later the same bucket holds a new period. Clearing the
+    // slots the burst filled left none of it behind
+    mono_time lap = start + buckets(DEDUP_BUCKETS);
+    for (int i = 0; i < 10; i++)
+        CHECK(filter.insert(nthHash(i), lap));
+    for (int i = 0; i < 10; i++)
+        CHECK(!filter.insert(nthHash(i), lap));
+    for (int i = 10; i < burst; i += 97)
+        CHECK(filter.insert(nthHash(i), lap));
+
+    // That period was small, so the next reset shrinks the tables instead
+    mono_time next_lap = lap + buckets(DEDUP_BUCKETS);
+    for (int i = 0; i < 10; i++)
+        CHECK(filter.insert(nthHash(i), next_lap));
+    for (int i = 0; i < 10; i++)
+        CHECK(!filter.insert(nthHash(i), next_lap));
+}
+
+void testHashFrame()
+{
+    uint8_t payload[28];
+    memset(payload, 7, sizeof(payload));
+    frame_ptr a = makeFrame(MAVLINK_MSG_ID_ATTITUDE, 1, 1, 10, payload, sizeof(payload));
+    frame_ptr same = makeFrame(MAVLINK_MSG_ID_ATTITUDE, 1, 1, 10, payload, sizeof(payload));
+    frame_ptr next_seq = makeFrame(MAVLINK_MSG_ID_ATTITUDE, 1, 1, 11, payload, sizeof(payload));
+    frame_ptr other_system = makeFrame(MAVLINK_MSG_ID_ATTITUDE, 2, 1, 10, payload, sizeof(payload));
+    payload[27] = 8;
+    frame_ptr other_payload = makeFrame(MAVLINK_MSG_ID_ATTITUDE, 1, 1, 10, payload, sizeof(payload));
+
+    uint64_t hash = dedupfilter::hashFrame(*a);
+    CHECK(hash == dedupfilter::hashFrame(*same));
+    CHECK(hash != dedupfilter::hashFrame(*next_seq));
+    CHECK(hash != dedupfilter::hashFrame(*other_system));
+    CHECK(hash != dedupfilter::hashFrame(*other_payload));
+}
+}
+
+int testDedupfilter()
+{
+    testRepeats();
+    testWindow();
+    testBucketReuse();
+    testHashFrame();
+    return testResult();
+}
@@ -0,0 +1,100 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * LATENCY HISTOGRAM TESTS
+ * Percentiles stay within a bucket's width of the exact value, and the
+ * totals and inclusive le counts the metrics are built from add up.
+ */
+
+#include "test.h"
+
+#include <algorithm>
+
+#include "../src/latencyhistogram.h"
+
+namespace
+{
+// Buckets are at most 1/16 of their range wide
+bool within(mono_time value, mono_time exact)
+{
+    return value >= exact && value <= exact + std::max<mono_time>(exact / 16, 1);
+}
+
+void testEmpty()
+{
+    latencyhistogram histogram;
+    CHECK(histogram.count() == 0);
+    CHECK(histogram.percentile(0.5) == 0);
+    CHECK(histogram.max() == 0);
+    CHECK(histogram.countAtMost(1000) == 0);
+}
+
+void testSmallValuesExact()
+{
+    latencyhistogram histogram;
+    for (mono_time us = 0; us < LATENCY_SUB_COUNT; us++)
+        histogram.record(us);
+
+    // Below LATENCY_SUB_COUNT every value has a bucket of its own
+    CHECK(histogram.percentile(0) == 0);
+    CHECK(histogram.percentile(0.5) == LATENCY_SUB_COUNT / 2);
+    CHECK(histogram.percentile(1) == LATENCY_SUB_COUNT - 1);
+}
+
+void testPercentiles()
+{
+    latencyhistogram histogram;
+    for (mono_time us = 1; us <= 100000; us++)
+        histogram.record(us);
+
+    CHECK(histogram.count() == 100000);
+    CHECK(histogram.max() == 100000);
+    CHECK(histogram.sum() == (mono_time)100000 * 100001 / 2);
+    CHECK(within(histogram.percentile(0.5), 50001));
+    CHECK(within(histogram.percentile(0.99), 99001));
+    CHECK(within(histogram.percentile(0.999), 99901));
+    // Never past the largest value recorded
+    CHECK(histogram.percentile(1) == 100000);
+}
+
+void testCountAtMost()
+{
+    latencyhistogram histogram;
+    for (mono_time us = 1; us <= 5000; us++)
+        histogram.record(us);
+
+    // Exact at one less than a power of two, le buckets are inclusive
+    CHECK(histogram.countAtMost(0) == 0);
+    CHECK(histogram.countAtMost(1) == 1);
+    CHECK(histogram.countAtMost(255) == 255);
+    CHECK(histogram.countAtMost(4095) == 4095);
+    // Elsewhere rounded down to a bucket boundary
+    uint64_t around = histogram.countAtMost(3000);
+    CHECK(around <= 3000 && around >= 3000 - 3000 / 16);
+    CHECK(histogram.countAtMost(1 << 20) == 5000);
+}
+
+void testOutOfRange()
+{
+    latencyhistogram histogram;
+    histogram.record(-5);
+    mono_time huge = (mono_time)1 << (LATENCY_MAX_BITS + 2);
+    histogram.record(huge);
+
+    CHECK(histogram.count() == 2);
+    CHECK(histogram.percentile(0) == 0);
+    CHECK(histogram.percentile(1) == huge);
+    CHECK(histogram.max() == huge);
+    CHECK(histogram.countAtMost(huge - 1) == 1);
+}
+}
+
+int testLatencyhistogram()
+{
+    testEmpty();
+    testSmallValuesExact();
+    testPercentiles();
+    testCountAtMost();
+    testOutOfRange();
+    return testResult();
+}
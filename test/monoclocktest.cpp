@@ -0,0 +1,135 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * MONOCLOCK TESTS
+ * The virtual clock, and the link timeouts and repeat detection driven by
+ * it, without waiting in real time.
+ */
+
+#include "test.h"
+
+#include <string.h>
+
+namespace
+{
+frame_ptr heartbeat(uint8_t sysid, uint8_t compid)
+{
+    uint8_t payload[9] = {};
+    return makeFrame(MAVLINK_MSG_ID_HEARTBEAT, sysid, compid, 0, payload, sizeof(payload));
+}
+
+// Pops every pending route update, returns how many matched kind and key
+int countUpdates(mlink &link, route_update::update_kind kind, uint16_t key)
+{
+    int matched = 0;
+    route_update update;
+    while (link.qReadRouteUpdate(&update))
+    {
+        if (update.kind == kind && update.component == key)
+            matched++;
+    }
+    return matched;
+}
+
+void testVirtualClock()
+{
+    virtualclock::install(5 * MONO_US_PER_SEC);
+    CHECK(monoclock::now() == 5 * MONO_US_PER_SEC);
+    virtualclock::advance(10);
+    CHECK(monoclock::now() == 5 * MONO_US_PER_SEC + 10);
+    virtualclock::set(7);
+    CHECK(monoclock::now() == 7);
+
+    mono_time before = monoclock::steadyNow();
+    virtualclock::uninstall();
+    CHECK(monoclock::now() >= before);
+}
+
+void testSystemTimeout()
+{
+    virtualclock::install(100 * MONO_US_PER_SEC);
+    link_info info;
+    testlink link(info);
+
+    link.receive(heartbeat(7, 1));
+    CHECK(countUpdates(link, route_update::COMPONENT_SEEN, component_key(7, 1)) == 1);
+
+    // Quiet for exactly the timeout is still alive
+    virtualclock::advance(MAV_PACKET_TIMEOUT_MS * MONO_US_PER_MS);
+    link.housekeeping();
+    CHECK(countUpdates(link, route_update::SYSTEM_DEAD, component_key(7, 0)) == 0);
+
+    virtualclock::advance(MONO_US_PER_MS);
+    link.housekeeping();
+    CHECK(countUpdates(link, route_update::SYSTEM_DEAD, component_key(7, 0)) == 1);
+
+    virtualclock::uninstall();
+}
+
+void testComponentTimeout()
+{
+    virtualclock::install(100 * MONO_US_PER_SEC);
+    link_info info;
+    testlink link(info);
+
+    link.receive(heartbeat(7, 1));
+    link.receive(heartbeat(7, 2));
+    // Only to empty the queue of the two COMPONENT_SEEN updates
+    countUpdates(link, route_update::COMPONENT_SEEN, 0);
+
+    // Only component 1 keeps talking, so the system stays alive without 2
+    virtualclock::advance(6 * MONO_US_PER_SEC);
+    link.receive(heartbeat(7, 1));
+    virtualclock::advance((MAV_PACKET_TIMEOUT_MS + 1) * MONO_US_PER_MS - 6 * MONO_US_PER_SEC);
+    link.housekeeping();
+
+    int dead_components = 0, dead_systems = 0, other = 0;
+    route_update update;
+    while (link.qReadRouteUpdate(&update))
+    {
+        if (update.kind == route_update::COMPONENT_DEAD && update.component == component_key(7, 2))
+            dead_components++;
+        else if (update.kind == route_update::SYSTEM_DEAD)
+            dead_systems++;
+        else
+            other++;
+    }
+    CHECK(dead_components == 1);
+    CHECK(dead_systems == 0);
+    CHECK(other == 0);
+
+    virtualclock::uninstall();
+}
+
+void testRepeatWindow()
+{
+    virtualclock::install(100 * MONO_US_PER_SEC);
+    link_info info;
+    info.reject_repeat_packets = true;
+    testlink link(info);
+
+    uint8_t payload[28];
+    memset(payload, 3, sizeof(payload));
+    frame_ptr attitude = makeFrame(MAVLINK_MSG_ID_ATTITUDE, 9, 1, 42, payload, sizeof(payload));
+
+    link.receive(attitude);
+    link.receive(attitude);
+    CHECK(link.incoming() == 1);
+
+    // Long after the window the same bytes are a new packet
+    virtualclock::advance((DEDUP_MIN_WINDOW_MS + 2 * DEDUP_BUCKET_MS) * MONO_US_PER_MS);
+    link.receive(attitude);
+    CHECK(link.incoming() == 1);
+
+    virtualclock::uninstall();
+}
+}
+
+int testMonoclock()
+{
+    testVirtualClock();
+    testSystemTimeout();
+    testComponentTimeout();
+    testRepeatWindow();
+    return testResult();
+}
@@ -0,0 +1,164 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * PRIORITY QUEUE TESTS
+ * Default and overridden classes, strict and weighted ordering, latest only
+ * replacement and full class queues.
+ */
+
+#include "test.h"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../src/priorityqueue.h"
+
+namespace
+{
+const std::unordered_map<uint32_t, traffic_class> no_overrides;
+const std::vector<int> strict;
+const std::unordered_set<uint32_t> no_latest_only;
+
+// seq tells frames of the same message apart
+frame_ptr frame(uint32_t msgid, uint8_t seq, uint8_t compid = 1)
+{
+    uint8_t payload[9] = {};
+    return makeFrame(msgid, 1, compid, seq, payload, sizeof(payload));
+}
+
+bool push(priorityqueue &queue, const frame_ptr &frame)
+{
+    frame_ptr replaced;
+    return queue.push(frame, queue.classOf(frame->msgid), replaced) && !replaced;
+}
+
+void testClasses()
+{
+    priorityqueue queue(16, no_overrides, strict, no_latest_only);
+    CHECK(queue.classOf(MAVLINK_MSG_ID_HEARTBEAT) == traffic_class::HEARTBEAT);
+    CHECK(queue.classOf(MAVLINK_MSG_ID_COMMAND_LONG) == traffic_class::CONTROL);
+    CHECK(queue.classOf(MAVLINK_MSG_ID_PARAM_VALUE) == traffic_class::BULK);
+    CHECK(queue.classOf(MAVLINK_MSG_ID_ATTITUDE) == traffic_class::TELEMETRY);
+    // Outside the dialect
+    CHECK(queue.classOf(16777000) == traffic_class::TELEMETRY);
+
+    // Overrides only change the link they are set on
+    std::unordered_map<uint32_t, traffic_class> overrides;
+    overrides[MAVLINK_MSG_ID_PARAM_VALUE] = traffic_class::TELEMETRY;
+    overrides[MAVLINK_MSG_ID_ATTITUDE] = traffic_class::TELEMETRY;
+    priorityqueue overridden(16, overrides, strict, no_latest_only);
+    CHECK(overridden.classOf(MAVLINK_MSG_ID_PARAM_VALUE) == traffic_class::TELEMETRY);
+    CHECK(overridden.classOf(MAVLINK_MSG_ID_ATTITUDE) == traffic_class::TELEMETRY);
+    CHECK(queue.classOf(MAVLINK_MSG_ID_PARAM_VALUE) == traffic_class::BULK);
+}
+
+void testClassNames()
+{
+    for (int i = 0; i < TRAFFIC_CLASSES; i++)
+    {
+        traffic_class parsed;
+        CHECK(parseTrafficClass(trafficClassName((traffic_class)i), parsed));
+        CHECK(parsed == (traffic_class)i);
+    }
+    traffic_class unused;
+    CHECK(!parseTrafficClass("urgent", unused));
+}
+
+void testStrictOrder()
+{
+    priorityqueue queue(16, no_overrides, strict, no_latest_only);
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_PARAM_VALUE, 1)));
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_ATTITUDE, 2)));
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_ATTITUDE, 3)));
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_HEARTBEAT, 4)));
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_COMMAND_LONG, 5)));
+
+    // Highest class first, in order within a class
+    const uint8_t expected[] = { 5, 4, 2, 3, 1 };
+    for (size_t i = 0; i < sizeof(expected); i++)
+    {
+        frame_ptr popped;
+        CHECK(queue.pop(popped));
+        CHECK(popped && popped->seq == expected[i]);
+    }
+    frame_ptr popped;
+    CHECK(!queue.pop(popped));
+}
+
+void testWeighted()
+{
+    std::vector<int> weights = { 3, 1, 1, 1 };
+    priorityqueue queue(64, no_overrides, weights, no_latest_only);
+    for (int i = 0; i < 40; i++)
+    {
+        CHECK(push(queue, frame(MAVLINK_MSG_ID_COMMAND_LONG, i)));
+        CHECK(push(queue, frame(MAVLINK_MSG_ID_ATTITUDE, i)));
+    }
+
+    // Control gets three sends for each of telemetry's, interleaved
+    int control = 0, telemetry = 0;
+    for (int i = 0; i < 40; i++)
+    {
+        frame_ptr popped;
+        CHECK(queue.pop(popped));
+        if (popped->msgid == MAVLINK_MSG_ID_COMMAND_LONG)
+            control++;
+        else
+            telemetry++;
+        if (i == 3)
+            CHECK(telemetry == 1);
+    }
+    CHECK(control == 30);
+    CHECK(telemetry == 10);
+}
+
+void testLatestOnly()
+{
+    std::unordered_set<uint32_t> latest_only = { MAVLINK_MSG_ID_ATTITUDE };
+    priorityqueue queue(16, no_overrides, strict, latest_only);
+    CHECK(queue.isLatestOnly(MAVLINK_MSG_ID_ATTITUDE));
+    CHECK(!queue.isLatestOnly(MAVLINK_MSG_ID_HEARTBEAT));
+
+    frame_ptr replaced;
+    frame_ptr first = frame(MAVLINK_MSG_ID_ATTITUDE, 1);
+    CHECK(queue.push(first, traffic_class::TELEMETRY, replaced) && !replaced);
+    CHECK(queue.push(frame(MAVLINK_MSG_ID_ATTITUDE, 2), traffic_class::TELEMETRY, replaced));
+    CHECK(replaced == first);
+    replaced.reset();
+    // Another component is another stream
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_ATTITUDE, 3, 2)));
+    CHECK(queue.push(frame(MAVLINK_MSG_ID_ATTITUDE, 4), traffic_class::TELEMETRY, replaced));
+    CHECK(replaced && replaced->seq == 2);
+
+    frame_ptr popped;
+    CHECK(queue.pop(popped) && popped->seq == 4);
+    CHECK(queue.pop(popped) && popped->seq == 3);
+    CHECK(!queue.pop(popped));
+
+    // Once sent, the next sample queues again
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_ATTITUDE, 5)));
+    CHECK(queue.pop(popped) && popped->seq == 5);
+}
+
+void testFull()
+{
+    priorityqueue queue(2, no_overrides, strict, no_latest_only);
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_ATTITUDE, 1)));
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_ATTITUDE, 2)));
+    CHECK(!push(queue, frame(MAVLINK_MSG_ID_ATTITUDE, 3)));
+    // Each class has its own queue
+    CHECK(push(queue, frame(MAVLINK_MSG_ID_COMMAND_LONG, 4)));
+}
+}
+
+int testPriorityqueue()
+{
+    testClasses();
+    testClassNames();
+    testStrictOrder();
+    testWeighted();
+    testLatestOnly();
+    testFull();
+    return testResult();
+}
@@ -0,0 +1,113 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * RATE LIMITER TESTS
+ * Output rates of decimated streams, with and without arrival jitter, and
+ * the limit on catching up after a gap.
+ */
+
+#include "test.h"
+
+#include <string.h>
+
+#include "../src/ratelimiter.h"
+
+namespace
+{
+frame_ptr attitude(uint8_t sysid, mono_time received)
+{
+    uint8_t payload[28];
+    memset(payload, 1, sizeof(payload));
+    frame_ptr frame = makeFrame(MAVLINK_MSG_ID_ATTITUDE, sysid, 1, 0, payload, sizeof(payload));
+    frame->ingress_time = received;
+    return frame;
+}
+
+// Packets allowed from a 50Hz stream over seconds, each arrival moved by
+// up to jitter_us either way
+int allowedFrom50Hz(ratelimiter &limiter, int seconds, mono_time jitter_us)
+{
+    const mono_time start = 100 * (mono_time)MONO_US_PER_SEC;
+    uint32_t random = 12345;
+    int allowed = 0;
+    for (int i = 0; i < seconds * 50; i++)
+    {
+        // The same pseudo random jitter every run
+        random = random * 1103515245 + 12345;
+        mono_time jitter = jitter_us ? (mono_time)(random >> 8) % (2 * jitter_us + 1) - jitter_us : 0;
+        if (limiter.allow(*attitude(1, start + i * 20 * MONO_US_PER_MS + jitter)))
+            allowed++;
+    }
+    return allowed;
+}
+
+void testUnlimited()
+{
+    std::unordered_map<uint32_t, float> limits;
+    limits[MAVLINK_MSG_ID_GLOBAL_POSITION_INT] = 1;
+    ratelimiter limiter(limits);
+
+    for (int i = 0; i < 100; i++)
+        CHECK(limiter.allow(*attitude(1, 1000)));
+}
+
+void testSteadyRate()
+{
+    std::unordered_map<uint32_t, float> limits;
+    limits[MAVLINK_MSG_ID_ATTITUDE] = 5;
+    ratelimiter limiter(limits);
+
+    int allowed = allowedFrom50Hz(limiter, 10, 0);
+    CHECK(allowed >= 49 && allowed <= 51);
+}
+
+void testJitterKeepsRate()
+{
+    std::unordered_map<uint32_t, float> limits;
+    limits[MAVLINK_MSG_ID_ATTITUDE] = 5;
+    ratelimiter limiter(limits);
+
+    // Arrivals up to 8ms early or late don't push slots back a packet
+    int allowed = allowedFrom50Hz(limiter, 20, 8 * MONO_US_PER_MS);
+    CHECK(allowed >= 99 && allowed <= 101);
+}
+
+void testPerSystem()
+{
+    std::unordered_map<uint32_t, float> limits;
+    limits[MAVLINK_MSG_ID_ATTITUDE] = 1;
+    ratelimiter limiter(limits);
+
+    CHECK(limiter.allow(*attitude(1, 1000)));
+    CHECK(limiter.allow(*attitude(2, 1000)));
+    CHECK(!limiter.allow(*attitude(1, 2000)));
+    CHECK(!limiter.allow(*attitude(2, 2000)));
+}
+
+void testGap()
+{
+    std::unordered_map<uint32_t, float> limits;
+    limits[MAVLINK_MSG_ID_ATTITUDE] = 5;
+    ratelimiter limiter(limits);
+    mono_time period = MONO_US_PER_SEC / 5;
+
+    mono_time t = 100 * (mono_time)MONO_US_PER_SEC;
+    CHECK(limiter.allow(*attitude(1, t)));
+
+    // After a gap only half a period is made up, no back to back packets
+    t += 5 * MONO_US_PER_SEC;
+    CHECK(limiter.allow(*attitude(1, t)));
+    CHECK(!limiter.allow(*attitude(1, t + period / 4)));
+    CHECK(limiter.allow(*attitude(1, t + period / 2)));
+}
+}
+
+int testRatelimiter()
+{
+    testUnlimited();
+    testSteadyRate();
+    testJitterKeepsRate();
+    testPerSystem();
+    testGap();
+    return testResult();
+}
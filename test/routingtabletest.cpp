@@ -0,0 +1,235 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * ROUTING TABLE TESTS
+ * Which links a frame is queued on: broadcasts, messages addressed to a
+ * system or one of its components, output rules, links taken down, and
+ * systems and components timing out.
+ */
+
+#include "test.h"
+
+#include <string.h>
+
+#include "../src/routingtable.h"
+
+namespace
+{
+enum { A, B, C, D, NUM_LINKS };
+
+unsigned long bit(int link_id)
+{
+    return 1ul << link_id;
+}
+
+frame_ptr heartbeat(uint8_t sysid, uint8_t compid)
+{
+    uint8_t payload[9] = {};
+    return makeFrame(MAVLINK_MSG_ID_HEARTBEAT, sysid, compid, 0, payload, sizeof(payload));
+}
+
+frame_ptr attitude(uint8_t sysid)
+{
+    uint8_t payload[28];
+    memset(payload, 1, sizeof(payload));
+    return makeFrame(MAVLINK_MSG_ID_ATTITUDE, sysid, 1, 0, payload, sizeof(payload));
+}
+
+// A COMMAND_LONG from sysid to the given target
+frame_ptr command(uint8_t sysid, uint8_t target_system, uint8_t target_component)
+{
+    const mavlink_msg_entry_t *entry = mavlink_get_msg_entry(MAVLINK_MSG_ID_COMMAND_LONG);
+    uint8_t payload[MAVLINK_MAX_PAYLOAD_LEN];
+    memset(payload, 1, sizeof(payload));
+    payload[entry->target_system_ofs] = target_system;
+    payload[entry->target_component_ofs] = target_component;
+    return makeFrame(MAVLINK_MSG_ID_COMMAND_LONG, sysid, 255, 0, payload, entry->max_msg_len);
+}
+
+// Four links: systems 1 behind A, 2 behind B and C (component 1 on B,
+// component 5 on C). D only outputs system 2 and drops ATTITUDE
+struct network
+{
+    std::vector<std::shared_ptr<mlink> > links;
+    std::unique_ptr<routingtable> table;
+
+    network()
+    {
+        for (int id = 0; id < NUM_LINKS; id++)
+        {
+            link_info info;
+            info.link_name = std::string(1, 'A' + id);
+            info.output_only_from.push_back(0);
+            if (id == D)
+            {
+                info.output_only_from[0] = 2;
+                info.filter_type = link_filter_type::DROP;
+                info.filter_messages.insert(MAVLINK_MSG_ID_ATTITUDE);
+            }
+            links.push_back(std::make_shared<testlink>(info));
+            links.back()->link_id = id;
+        }
+        table.reset(new routingtable(&links));
+
+        hear(A, heartbeat(1, 1));
+        hear(B, heartbeat(2, 1));
+        hear(C, heartbeat(2, 5));
+    }
+
+    testlink &link(int id)
+    {
+        return static_cast<testlink &>(*links[id]);
+    }
+
+    void hear(int id, const frame_ptr &frame)
+    {
+        link(id).receive(frame);
+        link(id).incoming();
+        table->update();
+    }
+
+    unsigned long route(const frame_ptr &frame, int from, unsigned long *down = nullptr)
+    {
+        boost::dynamic_bitset<> send_mask(NUM_LINKS), down_mask(NUM_LINKS);
+        table->route(*frame, *links[from], send_mask, down_mask);
+        if (down)
+            *down = down_mask.to_ulong();
+        return send_mask.to_ulong();
+    }
+};
+
+void testBroadcast()
+{
+    virtualclock::install(100 * MONO_US_PER_SEC);
+    network net;
+
+    // Never back where it came from, and D only takes system 2
+    CHECK(net.route(heartbeat(1, 1), A) == (bit(B) | bit(C)));
+    CHECK(net.route(attitude(1), A) == (bit(B) | bit(C)));
+    CHECK(net.route(heartbeat(2, 1), B) == (bit(A) | bit(C) | bit(D)));
+    // D's filter drops ATTITUDE
+    CHECK(net.route(attitude(2), B) == (bit(A) | bit(C)));
+    // Target system 0 is everyone
+    CHECK(net.route(command(1, 0, 0), A) == (bit(B) | bit(C)));
+
+    virtualclock::uninstall();
+}
+
+void testAddressed()
+{
+    virtualclock::install(100 * MONO_US_PER_SEC);
+    network net;
+
+    CHECK(net.route(command(2, 1, 0), B) == bit(A));
+    CHECK(net.route(command(1, 2, 0), A) == (bit(B) | bit(C)));
+    // A system nobody has heard from isn't routed anywhere
+    CHECK(net.route(command(1, 3, 1), A) == 0);
+
+    virtualclock::uninstall();
+}
+
+void testComponents()
+{
+    virtualclock::install(100 * MONO_US_PER_SEC);
+    network net;
+
+    CHECK(net.route(command(1, 2, 1), A) == bit(B));
+    CHECK(net.route(command(1, 2, 5), A) == bit(C));
+    // A component not heard yet may be behind any link of its system
+    CHECK(net.route(command(1, 2, 9), A) == (bit(B) | bit(C)));
+
+    // Component 5 moves to B as well
+    net.hear(B, heartbeat(2, 5));
+    CHECK(net.route(command(1, 2, 5), A) == (bit(B) | bit(C)));
+
+    virtualclock::uninstall();
+}
+
+void testComponentTimeout()
+{
+    virtualclock::install(100 * MONO_US_PER_SEC);
+    network net;
+    net.hear(B, heartbeat(2, 5));
+
+    // Component 5 goes quiet on B but keeps talking on C, system 2 stays
+    // alive on B through component 1
+    virtualclock::advance(6 * MONO_US_PER_SEC);
+    net.hear(A, heartbeat(1, 1));
+    net.hear(B, heartbeat(2, 1));
+    net.hear(C, heartbeat(2, 5));
+    virtualclock::advance(5 * MONO_US_PER_SEC);
+    for (int id = 0; id < NUM_LINKS; id++)
+        net.link(id).housekeeping();
+    net.table->update();
+
+    CHECK(net.route(command(1, 2, 5), A) == bit(C));
+    CHECK(net.route(command(1, 2, 1), A) == bit(B));
+
+    // Once C times out system 2 entirely, component 5 has no link left and
+    // falls back to the system's links
+    virtualclock::advance(6 * MONO_US_PER_SEC);
+    net.hear(B, heartbeat(2, 1));
+    virtualclock::advance(5 * MONO_US_PER_SEC);
+    for (int id = 0; id < NUM_LINKS; id++)
+        net.link(id).housekeeping();
+    net.table->update();
+
+    CHECK(net.route(command(1, 2, 5), A) == bit(B));
+
+    virtualclock::uninstall();
+}
+
+void testDownLink()
+{
+    virtualclock::install(100 * MONO_US_PER_SEC);
+    network net;
+
+    net.links[B]->up = false;
+    net.table->update();
+    unsigned long down;
+    CHECK(net.route(attitude(1), A, &down) == bit(C));
+    CHECK(down == bit(B));
+
+    net.links[B]->up = true;
+    net.table->update();
+    CHECK(net.route(attitude(1), A, &down) == (bit(B) | bit(C)));
+    CHECK(down == 0);
+
+    virtualclock::uninstall();
+}
+
+void testSystemTimeout()
+{
+    virtualclock::install(100 * MONO_US_PER_SEC);
+    network net;
+
+    // System 1 goes quiet on A
+    virtualclock::advance(6 * MONO_US_PER_SEC);
+    net.hear(B, heartbeat(2, 1));
+    net.hear(C, heartbeat(2, 5));
+    virtualclock::advance(5 * MONO_US_PER_SEC);
+    for (int id = 0; id < NUM_LINKS; id++)
+        net.link(id).housekeeping();
+    net.table->update();
+
+    CHECK(net.route(command(2, 1, 0), B) == 0);
+    CHECK(net.route(command(1, 2, 0), A) == (bit(B) | bit(C)));
+
+    // Heard again, routed again
+    net.hear(A, heartbeat(1, 1));
+    CHECK(net.route(command(2, 1, 0), B) == bit(A));
+
+    virtualclock::uninstall();
+}
+}
+
+int testRoutingtable()
+{
+    testBroadcast();
+    testAddressed();
+    testComponents();
+    testComponentTimeout();
+    testDownLink();
+    testSystemTimeout();
+    return testResult();
+}
@@ -0,0 +1,53 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * TESTS
+ * Entry points of the cmavnode_test units and the helpers they share.
+ * Nothing here is built into cmavnode itself.
+ */
+#ifndef TEST_H
+#define TEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../src/mavframe.h"
+#include "../src/mlink.h"
+
+// Records a failure and carries on, so one run reports every broken check
+#define CHECK(cond) checkResult((cond), #cond, __FILE__, __LINE__)
+
+void checkResult(bool ok, const char *expr, const char *file, int line);
+
+// What a unit returns: 0 if every check so far passed
+int testResult();
+
+// Units, each run as its own ctest test
+int testMonoclock();
+int testDedupfilter();
+int testLatencyhistogram();
+int testRatelimiter();
+int testPriorityqueue();
+int testRoutingtable();
+
+// A frame with a good checksum, header fields filled in
+frame_ptr makeFrame(uint32_t msgid, uint8_t sysid, uint8_t compid, uint8_t seq,
+                    const uint8_t *payload, uint8_t payload_len);
+
+// A link with no transport, fed frames as if they had just been received
+class testlink : public mlink
+{
+public:
+    testlink(link_info info_) : mlink(info_) {}
+
+    // Parses frame as received now, by monoclock
+    void receive(const frame_ptr &frame);
+
+    // Times out systems and components which have gone quiet
+    void housekeeping();
+
+    // Empties the incoming queue, returns how many frames were in it
+    int incoming();
+};
+
+#endif
@@ -0,0 +1,39 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * TESTS
+ * cmavnode_test <unit>, ctest runs each unit as a separate test.
+ */
+
+#include <iostream>
+#include <string>
+
+#include "test.h"
+
+int main(int argc, char** argv)
+{
+    std::string unit = argc > 1 ? argv[1] : "";
+
+    if (unit == "monoclock")
+        return testMonoclock();
+    if (unit == "dedupfilter")
+        return testDedupfilter();
+    if (unit == "latencyhistogram")
+        return testLatencyhistogram();
+    if (unit == "ratelimiter")
+        return testRatelimiter();
+    if (unit == "priorityqueue")
+        return testPriorityqueue();
+    if (unit == "routingtable")
+        return testRoutingtable();
+
+    std::cerr << "Usage: cmavnode_test <unit>" << std::endl
+              << "Units:" << std::endl
+              << "\tmonoclock\tvirtual time and system timeouts" << std::endl
+              << "\tdedupfilter\trepeat detection window and bucket reuse" << std::endl
+              << "\tlatencyhistogram\tpercentiles and le counts" << std::endl
+              << "\tratelimiter\toutput rates under jitter and after gaps" << std::endl
+              << "\tpriorityqueue\ttraffic classes, weights and latest only streams" << std::endl
+              << "\troutingtable\twhich links frames are queued on" << std::endl;
+    return 1;
+}
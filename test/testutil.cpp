@@ -0,0 +1,60 @@
+/* CMAVNode
+ * Monash UAS
+ *
+ * TESTS
+ * Helpers shared by the cmavnode_test units.
+ */
+
+#include "test.h"
+
+#include <iostream>
+
+#include "../bench/bench.h"
+
+namespace
+{
+int failures = 0;
+}
+
+void checkResult(bool ok, const char *expr, const char *file, int line)
+{
+    if (ok)
+        return;
+
+    std::cerr << file << ":" << line << ": check failed: " << expr << std::endl;
+    failures++;
+}
+
+int testResult()
+{
+    return failures == 0 ? 0 : 1;
+}
+
+frame_ptr makeFrame(uint32_t msgid, uint8_t sysid, uint8_t compid, uint8_t seq,
+                    const uint8_t *payload, uint8_t payload_len)
+{
+    frame_ptr frame = mavframe::alloc();
+    frame->len = buildFrame(msgid, sysid, compid, seq, payload, payload_len, frame->data);
+    frame->parseHeader();
+    return frame;
+}
+
+void testlink::receive(const frame_ptr &frame)
+{
+    rx_time = monoclock::now();
+    parseIncoming(frame->data, frame->len);
+}
+
+void testlink::housekeeping()
+{
+    checkForDeadSysID();
+}
+
+int testlink::incoming()
+{
+    int count = 0;
+    frame_ptr frame;
+    while (qReadIncoming(&frame))
+        count++;
+    return count;
+}